@@ -28,6 +28,15 @@
 #include                                "application.h"
 #include                                "lib/DS18B20.h"
 #include                                "lib/OneWire.h"
+#include                                "lib/pwm.h"
+#include                                "lib/fade.h"
+#include                                "lib/scene.h"
+#include                                "lib/color.h"
+#include                                "lib/calib.h"
+#include                                "lib/ambient.h"
+#include                                "lib/lux.h"
+#include                                "lib/event.h"
+#include                                "lib/pir.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Robot Configuration (Change your local settings here) //////////////////////
@@ -35,11 +44,12 @@
 
 #define                                 VERBOSE
 
-// Inputs (DYP-ME003 PIR Sensor -> D2 & TEMT6000 Ambient Light Sensor -> A0) ///
+// Inputs (DYP-ME003 PIR Sensor -> D1 & TEMT6000 Ambient Light Sensor -> A0) ///
+// The PIR pin must be a TIM4 capture input (D1 or D0) /////////////////////////
 
-const uint8_t pinPIR    =               2                                       ;
+const uint8_t pinPIR    =               1                                       ;
 const uint8_t pinAMB    =               10                                      ;
-const uint8_t pinTMP    =               4                                       ;
+typedef       OneWirePinD4              pinTMP                                  ;
 
 // Outputs (RGBW Channels -> [A4:A7] -> MOSFET/Gatedriver inputs ) /////////////
 
@@ -55,6 +65,32 @@ const uint8_t GPM       =               90; // Maximum Grace Period length in Se
 const uint8_t bNight    =               26; // Begin of Night hours
 const uint8_t eNight    =               6;  // End of Night hours
 
+/// Sensor tuning //////////////////////////////////////////////////////////////
+
+const uint8_t TAT       =               10; // Temp. Adaptive Threshold (0.1 C/min, 0: off)
+
+/// Light behaviour (timelines in flash, KF_RATE durations in ms per 1/255) ////
+
+constexpr Keyframe NIGHT_OFF[]  =       { keyframe(0x00000000, 20, EASE_LINEAR, KF_R | KF_RATE) };
+constexpr Keyframe NIGHT_ON[]   =       { keyframe(0x80000000, 40, EASE_LINEAR, KF_R | KF_RATE | KF_RAISE) };
+constexpr Keyframe NIGHT_DIM[]  =       { keyframe(0x40000000, 20, EASE_LINEAR, KF_R | KF_RATE | KF_LOWER) };
+constexpr Keyframe DAY_OFF[]    =       { keyframe(0x00000000, 20, EASE_LINEAR, KF_W | KF_RATE) };
+constexpr Keyframe DAY_DIM[]    =       { keyframe(0x00000080, 20, EASE_LINEAR, KF_W | KF_RATE | KF_LOWER) };
+constexpr Keyframe DAY_ON[]     =       { keyframe(0x000000C0, 40, EASE_LINEAR, KF_W | KF_RATE | KF_RAISE) };
+
+// Indexed [night][autolight target: 0 off, 1 presence on, 2 grace dim] ////////
+// Day presence has no timeline, W is regulated to a lux setpoint instead //////
+
+constexpr Scene AUTOLIGHT[2][3] =
+{
+    { { DAY_OFF,   1, 0 }, { NULL,     0, 0 }, { DAY_DIM,   1, 0 } },
+    { { NIGHT_OFF, 1, 0 }, { NIGHT_ON, 1, 0 }, { NIGHT_DIM, 1, 0 } },
+};
+
+// Day presence until a self-light table exists: fixed W, no regulation ///////
+
+constexpr Scene DAY_FIXED       =       { DAY_ON,    1, 0 }                     ;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Init ///////////////////////////////////////////////////////////////////////
@@ -64,24 +100,65 @@ const uint8_t eNight    =               6;  // End of Night hours
 
 uint8_t     EGP         =               GPB                                     ;
 
-// LEDs ////////////////////////////////////////////////////////////////////////
+// LEDs (16 bit duty, 0-65535) ////////////////////////////////////////////////
+
+int         ledR        =               0                                       ;
+int         ledG        =               0                                       ;
+int         ledB        =               0                                       ;
+int         ledW        =               0                                       ;
+
+// Scale of one 8 bit step (0-255) in 16 bit duty units ////////////////////////
+
+const uint16_t L8       =               257                                     ;
 
-uint8_t     ledR        =               0                                       ;
-uint8_t     ledG        =               0                                       ;
-uint8_t     ledB        =               0                                       ;
-uint8_t     ledW        =               0                                       ;
+// Fade engine channels ////////////////////////////////////////////////////////
+
+const uint8_t chR       =               0                                       ;
+const uint8_t chG       =               1                                       ;
+const uint8_t chB       =               2                                       ;
+const uint8_t chW       =               3                                       ;
+
+// PWM outputs, validated once in setup() //////////////////////////////////////
+
+PwmChannel  pwmR, pwmG, pwmB, pwmW                                              ;
 
 // Time ////////////////////////////////////////////////////////////////////////
 
 uint16_t    timeDiff    =               0                                       ;
 uint32_t    lastMotion  =               0                                       ;
 uint32_t    lastTSync   =               0                                       ;
+uint32_t    lastTPub    =               0                                       ;
+
+// Temperature events: changes only, at most one per period (cloud limit 1/s) //
+
+const uint32_t TMP_PUBLISH_MS =         10000                                   ;
 
 // Environment  ////////////////////////////////////////////////////////////////
 
 uint16_t    ambLux      =               0                                       ;
 float       ambTmp      =               0                                       ;
+char        ambTmps[48]                                                         ;
 char        tmpData[64]                                                         ;
+boolean     tmpDirty    =               false                                   ;
+
+// Self-light table learned and saved (false while luxLearn() runs) ////////////
+
+boolean     luxLearned  =               true                                    ;
+
+// Motion fast path: presence ramp armed for the PIR interrupt, edge to light //
+// latency in us (last, worst), validation included ////////////////////////////
+
+const uint16_t ARM_DELTA =              4 * L8  /* re-arm: day target moved  */;
+
+boolean     fastPath    =               true                                    ;
+boolean     armedNight  =               false                                   ;
+uint16_t    armedW      =               0                                       ;
+volatile uint32_t fastLat =             0                                       ;
+volatile uint32_t fastLatMax =          0                                       ;
+
+// Diagnostics (error counters, exposed as "diag") /////////////////////////////
+
+char        diag[384]                                                           ;
 
 // Bitwise State Table /////////////////////////////////////////////////////////////
 /*
@@ -89,22 +166,36 @@ char        tmpData[64]
    0x2                  :               PIR Motion triggered
    0x4                  :               Human Presence
    0x8                  :               Grace Period
-   0x16                 :               Event Notification
-   0x32                 :               Night
+   0x10                 :               Event Notification
+   0x20                 :               Night
 */
 
 uint8_t     state       =               0x0                                     ;
 
+// Events for loop(): one queue per producer (PIR interrupt, alerts) ///////////
+// Cloud functions aren't queued: they already run between loop() passes ///////
+// and their return value is the caller's result ///////////////////////////////
+
+EventQueue  <16>        motionEvents                                            ;
+EventQueue  <8>         alertEvents                                             ;
+
 // Function prototypes /////////////////////////////////////////////////////////
 
 int                     setRGBW         (String rgbwInt)                        ;
-void                    setPWM          (uint8_t pin, uint8_t value)            ;
+int                     config          (String cmd)                            ;
+int                     sceneCmd        (String cmd)                            ;
+int                     calibCmd        (String cmd)                            ;
 void                    fadeTo          (long rgbw, int delaytime)              ;
+void                    fadeToSync      (long rgbw, uint32_t duration,
+                                         uint8_t space = COLOR_RGB)              ;
+const Scene            *autoScene       (boolean night, int target)             ;
 void                    autolight       (int target)                            ;
+void                    armPresence     (void)                                  ;
 void                    motionISR       (void)                                  ;
 void                    alertESR        (const char *event, const char *data)   ;
+void                    updateDiag      (void)                                  ;
 uint16_t                readT6K         (void)                                  ;
-float                   readDS18B20     (void)                                  ;
+boolean                 readDS18B20     (void)                                  ;
 
 
 
@@ -112,7 +203,10 @@ float                   readDS18B20     (void)
 /// Setup //////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-DS18B20 ds18b20         = DS18B20       (pinTMP)                                ;
+// Pin bound at compile time, no heap. With ONEWIRE_USART use the run time
+// variant on the TX pin instead: DS18B20 ds18b20 = DS18B20(TX);
+
+StaticDS18B20           <pinTMP>        ds18b20                                 ;
 
 SYSTEM_MODE                             (AUTOMATIC)                             ;
 
@@ -125,10 +219,15 @@ void                    setup           ()
     ////////////////////////////////////////////////////////////////////////////
     /// Pre-Define port direction & attach Interrupts //////////////////////////
 
-    // Set up DYP-ME003 Passive Infrared Sensor ////////////////////////////////
+    // Set up TEMT6000 Ambient Light Sensor, ADC + DMA, synced to PWM below ///
+
+    luxBegin                            (pinAMB)                                ;
+
+    // Set up DYP-ME003 Passive Infrared Sensor, pulses timed by TIM4 capture //
+    // and only plausible ones (see "pirfilter") reach motionISR ///////////////
 
     pinMode                             (pinPIR, INPUT_PULLDOWN)                ;
-    attachInterrupt                     (pinPIR, motionISR, RISING)             ;
+    pirBegin                            (pinPIR, motionISR)                     ;
 
     // Set up MOSFET Gate Driver output lines //////////////////////////////////
 
@@ -142,10 +241,44 @@ void                    setup           ()
     /// one of the Core's PWM output pins and the gate driver's input pin or all
     /// hell would break loose (especially when waving my hands over it) :)
 
-    setPWM                              (pinR, 0)                               ;
-    setPWM                              (pinG, 0)                               ;
-    setPWM                              (pinB, 0)                               ;
-    setPWM                              (pinW, 0)                               ;
+    pwmR.begin                          (pinR)                                  ;
+    pwmG.begin                          (pinG)                                  ;
+    pwmB.begin                          (pinB)                                  ;
+    pwmW.begin                          (pinW)                                  ;
+
+    // Sample ambient light at the end of every PWM period (LEDs off) //////////
+
+    luxSync                             (pwmW.timer())                          ;
+
+    // Fixture calibration from EEPROM, applied to every frame from now on ////
+
+    calibInit                           ()                                      ;
+
+    // Hand the channels over to the non-blocking fade engine //////////////////
+
+    fadeInit                            (chR, &pwmR, &ledR)                     ;
+    fadeInit                            (chG, &pwmG, &ledG)                     ;
+    fadeInit                            (chB, &pwmB, &ledB)                     ;
+    fadeInit                            (chW, &pwmW, &ledW)                     ;
+    ambientInit                         (chW)                                   ;
+
+    // No self-light table in EEPROM (fresh device): learn one now, loop() /////
+    // saves it when done. Day regulation waits for it (see autolight) ////////
+
+    if                                  (!luxKnown())
+    {
+        PwmChannel *ch[]    =           { &pwmR, &pwmG, &pwmB, &pwmW }          ;
+
+        if                              (luxLearn(ch, 4))
+        {
+            luxLearned  =               false                                   ;
+        }
+    }
+
+    // Enumerate the 1-Wire bus once, ROM codes are cached from now on /////////
+
+    ds18b20.enumerate                   ()                                      ;
+    ds18b20.setAdaptive                 (TAT / 10.0)                            ;
 
     ////////////////////////////////////////////////////////////////////////////
     /// Expose variables & function through spark-server API ///////////////////
@@ -156,7 +289,12 @@ void                    setup           ()
     Spark.variable                      ("ledw",    &ledW,      INT)            ;
     Spark.variable                      ("amblux",  &ambLux,    INT)            ;
     Spark.variable                      ("ambtmp",  &ambTmp, DOUBLE)            ;
+    Spark.variable                      ("ambtmps", ambTmps,    STRING)         ;
+    Spark.variable                      ("diag",    diag,       STRING)         ;
     Spark.function                      ("setrgbw", setRGBW        )            ;
+    Spark.function                      ("config",  config         )            ;
+    Spark.function                      ("scene",   sceneCmd       )            ;
+    Spark.function                      ("calib",   calibCmd       )            ;
     Spark.subscribe                     ("alerts",  alertESR       )            ;
 
     ////////////////////////////////////////////////////////////////////////////
@@ -173,6 +311,29 @@ void                    setup           ()
 
 void                    loop            ()
 {
+    ////////////////////////////////////////////////////////////////////////////
+    /// Self-light learning owns the outputs until it is done //////////////////
+
+    if                                  (luxLearning())
+    {
+        return                                                                  ;
+    }
+
+    if                                  (!luxLearned)
+    {
+        luxSave                         ()                                      ;
+        fadeRefresh                     ()                                      ;
+        luxLearned      =               true                                    ;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// Advance the running timeline and fades /////////////////////////////////
+
+    sceneTick                           ()                                      ;
+    colorTick                           ()                                      ;
+    fadeTick                            ()                                      ;
+
+
     ////////////////////////////////////////////////////////////////////////////
     /// Already time to request time synchronization (1h)? /////////////////////
 
@@ -184,26 +345,51 @@ void                    loop            ()
 
 
     ////////////////////////////////////////////////////////////////////////////
-    /// Is the motion trigger state bit set (new motion detected)? /////////////
+    /// Drain the events queued by the PIR interrupt and alert handler /////////
+
+    Event       event                                                           ;
+    uint8_t     motions =               0                                       ;
 
-    if                                  ((state & 0x2) == 0x2)
+    while                               (motionEvents.pop(event) ||
+                                         alertEvents.pop(event))
     {
+        if                              (event.type == EVENT_MOTION)
+        {
+            // Keep the edge's own timestamp, not when we got around to it ////
+
+            lastMotion  =               event.time                              ;
+            motions++                                                           ;
+        }
+        else if                         (event.type == EVENT_ALERT)
+        {
+            // Set event notification state bit (16) ///////////////////////////
+
+            state      |=               0x10                                    ;
+        }
+
         #ifdef VERBOSE
-            Serial.println              ("Motion Detected")                     ;
+            Serial.print                (" -> Event ")                          ;
+            Serial.print                (event.type)                            ;
+            Serial.print                (" (")                                  ;
+            Serial.print                (event.arg)                             ;
+            Serial.print                (") at ")                               ;
+            Serial.println              (event.time)                            ;
         #endif
+    }
 
-        // Clear motion trigger state bit //////////////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////
+    /// New motion detected? ///////////////////////////////////////////////////
 
-        state          &=               ~0x2                                    ;
+    if                                  (motions > 0)
+    {
+        #ifdef VERBOSE
+            Serial.println              ("Motion Detected")                     ;
+        #endif
 
         // Publish our motion event through our spark-server's event firehose //
 
         Spark.publish                   ("motion", NULL, 60, PRIVATE)           ;
 
-        // Remember the timestamp of this event ////////////////////////////////
-
-        lastMotion      = millis        ()                                      ;
-
         // New presence detected (presence state bit not set)? /////////////////
 
         if                              ((state & 0x4) == 0)
@@ -231,11 +417,12 @@ void                    loop            ()
             autolight                   (1)                                     ;
         }
 
-        // Honor current presence's movement by increasing time to GP //////////
+        // Honor current presence's movement by increasing time to GP, //////////
+        // once per motion since the last pass /////////////////////////////////
 
         else if                         ((state & 0x4) == 0x4)
         {
-            if(EGP < GPM)
+            for                         (; motions > 0 && EGP < GPM; motions--)
             {
                 #ifdef VERBOSE
                     Serial.println      (" -> Boosting GP +10...")              ;
@@ -310,10 +497,49 @@ void                    loop            ()
     }
 
     ambLux              = readT6K       ()                                      ;
-    ambTmp              = readDS18B20   ()                                      ;
 
-    sprintf                             (tmpData, "{ 'C': %4.1f }", ambTmp)     ;
-    Spark.publish                       ("temperature", tmpData, 60, PRIVATE)   ;
+    // Day mode: the PI controller holds W at the lux setpoint. ambLux has /////
+    // our own light taken out, the controller has to see what W adds /////////
+
+    uint16_t    lamp    =               luxLamp()                               ;
+
+    ambientTick                         (ambLux + lamp, lamp)                   ;
+
+    ////////////////////////////////////////////////////////////////////////////
+    /// Light idle and nobody (or grace)? Keep the presence ramp armed /////////
+
+    if                                  (  fastPath
+                                        && ((state & 0x4) == 0 || (state & 0x8))
+                                        && !sceneActive() && !colorActive()
+                                        && !ambientActive())
+    {
+        armPresence                     ()                                      ;
+    }
+
+    // New conversion: note whether the published text changed /////////////////
+
+    if                                  (readDS18B20())
+    {
+        char    data    [sizeof(tmpData)]                                       ;
+
+        sprintf                         (data, "{ 'C': %4.1f, 'N': [%s] }",
+                                         ambTmp, ambTmps)                       ;
+
+        tmpDirty       |=               (strcmp(data, tmpData) != 0)            ;
+        strcpy                          (tmpData, data)                         ;
+    }
+
+    // Publish a change once the last event is TMP_PUBLISH_MS old //////////////
+
+    if                                  (  tmpDirty
+                                        && millis() - lastTPub >= TMP_PUBLISH_MS)
+    {
+        Spark.publish                   ("temperature", tmpData, 60, PRIVATE)   ;
+        tmpDirty        =               false                                   ;
+        lastTPub        =               millis()                                ;
+    }
+
+    updateDiag                          ()                                      ;
 
     #ifdef VERBOSE
         Serial.print                    (" -> Timestamp: ")                     ;
@@ -335,234 +561,607 @@ void                    loop            ()
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+const Scene            *autoScene       (boolean night, int target)
+{
+    // luxLamp() is 0 without a table, the controller would never see its
+    // own light and run W into a rail: the fixed day scene stands in
+
+    if                                  (!night && target == 1 && !luxKnown())
+    {
+        return                          &DAY_FIXED                              ;
+    }
+
+    return                              &AUTOLIGHT[night][target]               ;
+}
+
+
 void                    autolight       (int target)
 {
-    if                                  (target == 1)
+    // The behaviours are the AUTOLIGHT timelines, this only picks one. A new
+    // scene or command preempts from the current values, so automatic fades
+    // and user/event overrides can't fight over a channel.
+
+    boolean night       =               (  Time.hour() < eNight
+                                        || Time.hour() > bNight)                ;
+
+    colorStop                           ()                                      ;
+    scenePlay                           (autoScene(night, target))              ;
+
+    // Day presence: regulated from here on, dims back when sunlight rises /////
+
+    if                                  (!night && target == 1 && luxKnown())
+    {
+        ambientStart                    ()                                      ;
+    }
+    else
     {
-        ////////////////////////////////////////////////////////////////////////
-        // Ramp up to Maximum, depending on time/environment ///////////////////
+        ambientStop                     ()                                      ;
+    }
+}
 
-        if                              (  Time.hour() < eNight
-                                        || Time.hour() > bNight)
-        {
-            // Night mode //////////////////////////////////////////////////////
 
-            while                       (ledR < 128)
-            {
-                ledR++                                                          ;
-                setPWM                  (pinR, ledR)                            ;
-                delay                   (40)                                    ;
-            }
-        }
-        else
-        {
-            // Day mode ////////////////////////////////////////////////////////
+void                    armPresence     (void)
+{
+    // Primes the move autolight(1) would make: the night timeline's first
+    // keyframe, by day the controller's first step. The PIR interrupt fires
+    // it, loop() then plays autolight(1) as usual, which carries on from
+    // wherever the ramp got. An armed ramp is only replaced when day turns
+    // to night (or back) or the day target has moved by ARM_DELTA.
 
-            while                       (ledW < 255 && ambLux < 250)
-            {
-                ledW                    ++                                      ;
-                setPWM                  (pinW, ledW)                            ;
-                delay                   (20)                                    ;
-                ambLux  = readT6K       ()                                      ;
-            }
-        }
+    boolean night       =               (  Time.hour() < eNight
+                                        || Time.hour() > bNight)                ;
+    uint16_t    target  [FADE_CHANNELS]                                         ;
+    uint32_t    duration                                                        ;
+
+    duration            =               scenePreview(autoScene(night, 1),
+                                                     target)                    ;
+
+    if                                  (!night && luxKnown())
+    {
+        target[chW]     =               ambientEstimate(ambLux + luxLamp())     ;
+        duration        =               AMBIENT_PERIOD_MS                       ;
     }
 
-    else if                             (target == 2)
+    if                                  (  fadeArmed() && night == armedNight
+                                        && (  night
+                                           || abs(target[chW] - armedW)
+                                              < ARM_DELTA))
     {
-        ////////////////////////////////////////////////////////////////////////
-        // Fade Down a little to notifiy present humans to move ////////////////
+        return                                                                  ;
+    }
 
-        if                              (  Time.hour() < eNight
-                                        || Time.hour() > bNight)
-        {
-            // Night mode //////////////////////////////////////////////////////
+    armedNight          =               night                                   ;
+    armedW              =               target[chW]                             ;
+    fadeArm                             (target, duration)                      ;
+}
 
-            while                       (ledR > 64)
-            {
-                ledR--                                                          ;
-                setPWM                  (pinR, ledR)                            ;
-                delay                   (20)                                    ;
-            }
-        }
-        else
-        {
-            // Day mode ////////////////////////////////////////////////////////
 
-            while                       (ledW > 128)
-            {
-                ledW--                                                          ;
-                setPWM                  (pinW, ledW)                            ;
-                delay                   (20)                                    ;
-            }
-        }
+void                    fadeTo          (long rgbw, int delaytime)
+{
+    #ifdef VERBOSE
+        Serial.println                  ("Fading to new target")                ;
+    #endif
+
+    // Separate colors from combined 32bit RGBA long ///////////////////////////
+
+    int     newR        =               L8 * ((rgbw >> 24) & 0xFF)              ;
+    int     newG        =               L8 * ((rgbw >> 16) & 0xFF)              ;
+    int     newB        =               L8 * ((rgbw >>  8) & 0xFF)              ;
+    int     newW        =               L8 * ((rgbw >>  0) & 0xFF)              ;
+
+    // One step per delaytime on every channel, as the old blocking loop did //
+
+    sceneStop                           ()                                      ;
+    colorStop                           ()                                      ;
+
+    fadeStart                           (chR, newR, abs(newR - ledR) * delaytime / L8);
+    fadeStart                           (chG, newG, abs(newG - ledG) * delaytime / L8);
+    fadeStart                           (chB, newB, abs(newB - ledB) * delaytime / L8);
+    fadeStart                           (chW, newW, abs(newW - ledW) * delaytime / L8);
+
+    // A user override ends the ambient light control //////////////////////////
+
+    ambientStop                         ()                                      ;
+
+    #ifdef VERBOSE
+        Serial.print                    ("R: ")                                 ;
+        Serial.println                  (newR)                                  ;
+        Serial.print                    ("G: ")                                 ;
+        Serial.println                  (newG)                                  ;
+        Serial.print                    ("B: ")                                 ;
+        Serial.println                  (newB)                                  ;
+        Serial.print                    ("W: ")                                 ;
+        Serial.println                  (newW)                                  ;
+    #endif
+}
+
+void                    fadeToSync      (long rgbw, uint32_t duration,
+                                         uint8_t space)
+{
+    #ifdef VERBOSE
+        Serial.print                    ("Fading in sync over ms: ")            ;
+        Serial.println                  (duration)                              ;
+    #endif
+
+    // Separate colors from combined 32bit RGBA long, in channel order /////////
+
+    uint16_t target[FADE_CHANNELS]                                              ;
+
+    target[chR]         =               L8 * ((rgbw >> 24) & 0xFF)              ;
+    target[chG]         =               L8 * ((rgbw >> 16) & 0xFF)              ;
+    target[chB]         =               L8 * ((rgbw >>  8) & 0xFF)              ;
+    target[chW]         =               L8 * ((rgbw >>  0) & 0xFF)              ;
+
+    sceneStop                           ()                                      ;
+    colorFade                           (target, duration, space)               ;
+
+    ambientStop                         ()                                      ;
+}
+
+uint16_t                readT6K         (void)
+{
+    // Sampled, decimated and filtered in the background (lib/lux.h), only a ///
+    // load here. Scale as documented with LUX_PER_COUNT ///////////////////////
+
+    return                              luxRead()                               ;
+}
+
+boolean                 readDS18B20     (void)
+{
+    // Advance the non-blocking conversion pipeline, never waits on the bus ////
+
+    if                                  (!ds18b20.update())
+    {
+        return                          false                                   ;
     }
 
-    else
+    ambTmp              = ds18b20.      lastTemperature(0)                      ;
+
+    // Comma separated list of all probes for the ambtmps variable /////////////
+
+    uint8_t len         =               0                                       ;
+    ambTmps[0]          =               0                                       ;
+
+    for                                 (uint8_t i = 0;
+                                         i < ds18b20.getDeviceCount(); i++)
     {
-        ////////////////////////////////////////////////////////////////////////
-        // Fade Down all
-        // FIXME: This is still buggy, there has to be some more thought about
-        // collisions between autolight and user/event overrides.
+        len            +=               sprintf(ambTmps + len, i ? ",%.1f" : "%.1f",
+                                                ds18b20.lastTemperature(i))     ;
+    }
 
-        if                              (  Time.hour() < eNight
-                                        || Time.hour() > bNight)
-        {
-            // Night mode //////////////////////////////////////////////////////
+    return                              true                                    ;
+}
 
-            while                       (ledR > 0)
-            {
-                ledR--                                                          ;
-                setPWM                  (pinR, ledR)                            ;
-                delay                   (20)                                    ;
-            }
-        }
-        else
-        {
-            // Day mode ////////////////////////////////////////////////////////
+void                    motionISR       (void)
+{
+    // Called by the PIR capture once a pulse passed the filter ////////////////
+    // Light first: the armed presence ramp starts in hardware right away //////
 
-            while                       (ledW > 0)
-            {
-                ledW--                                                          ;
-                setPWM                  (pinW, ledW)                            ;
-                delay                   (20)                                    ;
-            }
-        }
+    boolean     fired   =               fadeFire()                              ;
+    uint32_t    age     =               pirAge()                                ;
+
+    if                                  (fired)
+    {
+        fastLat         =               age                                     ;
+        fastLatMax      =               (age > fastLatMax) ? age : fastLatMax   ;
     }
+
+    // Queue the rising edge's time, loop() does the rest ///////////////////////
+    // (argument 1: the fast path lit already) /////////////////////////////////
+
+    motionEvents.push                   (EVENT_MOTION, fired,
+                                         millis() - age / 1000)                 ;
+
+    RGB.control                         (true)                                  ;
+    RGB.color                           (30, 255, 5)                            ;
 }
 
+void                    alertESR        (const char *event, const char *data)
+{
+    // Queued for loop(), the state byte is only touched there /////////////////
+
+    alertEvents.push                    (EVENT_ALERT, 0, millis())              ;
 
-void                    fadeTo          (long rgbw, int delaytime)
+    #ifdef VERBOSE
+        Serial.print                    (" -> Event Received: ")                ;
+        Serial.println                  (data)                                  ;
+    #endif
+
+    //FIXME: Well, do something with it
+    //setPWM                              (pinB, 255)                            ;
+}
+
+void                    updateDiag      (void)
 {
-    uint8_t completed   =               0x0                                     ;
+    uint32_t    dAvg, dMax                                                      ;
+    uint16_t    dLoad   =               pwmDitherLoad(pwmR.timer(), &dAvg, &dMax);
+    uint32_t    cAvg, cMax                                                      ;
+    PirStats    pir                                                             ;
+
+    colorTickLoad                       (&cAvg, &cMax)                          ;
+
+    pirStats                            (&pir)                                  ;
+
+    sprintf                             (diag, "{ 'owcrc': %lu, 'owfail': %lu, "
+                                         "'dcyc': %lu, 'dmax': %lu, 'dload': %u, "
+                                         "'ccyc': %lu, 'cmax': %lu, "
+                                         "'self': %u, 'lamp': %u, "
+                                         "'qmot': %lu, 'qalr': %lu, "
+                                         "'mlat': %lu, 'mlatmax': %lu, "
+                                         "'pirok': %lu, 'pirshort': %lu, "
+                                         "'pirlone': %lu, 'pirw': %lu, "
+                                         "'piri': %lu }",
+                                (unsigned long) ds18b20.getCrcErrors(),
+                                (unsigned long) ds18b20.getFailures(),
+                                (unsigned long) dAvg, (unsigned long) dMax,
+                                dLoad,
+                                (unsigned long) cAvg, (unsigned long) cMax,
+                                luxSelf(), luxLamp(),
+                                (unsigned long) motionEvents.dropped(),
+                                (unsigned long) alertEvents.dropped(),
+                                (unsigned long) fastLat,
+                                (unsigned long) fastLatMax,
+                                (unsigned long) pir.accepted,
+                                (unsigned long) pir.tooShort,
+                                (unsigned long) pir.unconfirmed,
+                                (unsigned long) pir.width,
+                                (unsigned long) pir.interval)                   ;
+}
 
+int                     config          (String cmd)
+{
     #ifdef VERBOSE
-        Serial.println                  ("Fading to new target")                ;
+        Serial.print                    ("config Called: ")                     ;
+        Serial.println                  (cmd)                                   ;
     #endif
 
-    // Separate colors from combined 32bit RGBA long ///////////////////////////
+    // Commands are "key" or "key=value" ///////////////////////////////////////
+
+    int     sep         =               cmd.indexOf('=')                        ;
+    String  key         =               (sep < 0) ? cmd : cmd.substring(0, sep) ;
+
+    if                                  (key == "rescan")
+    {
+        // Re-enumerate the 1-Wire bus after adding/removing probes ////////////
+
+        return                          ds18b20.enumerate()                     ;
+    }
 
-    uint8_t newR        =               (rgbw >> 24) & 0xFF                     ;
-    uint8_t newG        =               (rgbw >> 16) & 0xFF                     ;
-    uint8_t newB        =               (rgbw >>  8) & 0xFF                     ;
-    uint8_t newW        = (int)         ((rgbw >> 0) & 0xFF)                    ;
+    long    value       =               cmd.substring(sep + 1).toInt()          ;
 
-    while                               (completed != 15)
+    if                                  (key == "tmpres")
     {
-        // Red Channel /////////////////////////////////////////////////////////
+        // Fixed resolution (9-12 bit) for all probes, disables adaptive mode //
+        // -1 if out of range or no probe took it //////////////////////////////
 
-        if                              (ledR < newR)
+        if                              (value < 9 || value > 12)
         {
-            ledR++                                                              ;
-            setPWM                      (pinR, ledR)                            ;
+            return                      -1                                      ;
         }
-        else if                         (ledR > newR)
+
+        uint8_t set     =               0                                       ;
+
+        ds18b20.setAdaptive             (0)                                     ;
+
+        for                             (uint8_t i = 0;
+                                         i < ds18b20.getDeviceCount(); i++)
         {
-            ledR--                                                              ;
-            setPWM                      (pinR, ledR)                            ;
+            set        +=               ds18b20.setResolution(i, value)         ;
         }
-        else { completed |= 0x1; }
 
-        // Green Channel ///////////////////////////////////////////////////////
+        return                          (set > 0) ? value : -1                  ;
+    }
+
+    if                                  (key == "tmpadapt")
+    {
+        // Adaptive threshold in 1/10 degC per minute, 0 disables //////////////
+
+        ds18b20.setAdaptive             (value / 10.0)                          ;
+        return                          value                                   ;
+    }
+
+    if                                  (key == "pwmfreq")
+    {
+        // PWM frequency of the LED timers in Hz, above ~17.5 kHz the LSBs ///
+        // are dithered. Returns the frequency actually set (0: out of range) //
 
-        if                              (ledG < newG)
+        if                              (sep < 0)
         {
-            ledG++                                                              ;
-            setPWM                      (pinG, ledG)                            ;
+            return                      pwmGetFrequency(pwmR.timer())           ;
         }
-        else if                         (ledG > newG)
+
+        PwmChannel *ch[]    =           { &pwmR, &pwmG, &pwmB, &pwmW }          ;
+        uint32_t    hz      =           0                                       ;
+
+        for                             (uint8_t i = 0; i < 4; i++)
         {
-            ledG--                                                              ;
-            setPWM                      (pinG, ledG)                            ;
+            hz          =               pwmSetFrequency(ch[i]->timer(), value)  ;
         }
-        else { completed |= 0x2; }
 
-        // Blue Channel ////////////////////////////////////////////////////////
+        // Re-arms the fast path at the new rate ///////////////////////////////
+
+        fadeRefresh                     ()                                      ;
+
+        return                          hz                                      ;
+    }
+
+    if                                  (key == "fastpath")
+    {
+        // Light from the PIR interrupt (1) or only from loop() (0), resets ///
+        // the latency figures /////////////////////////////////////////////////
+
+        fastPath        =               (value != 0)                            ;
+        fastLat         =               0                                       ;
+        fastLatMax      =               0                                       ;
+
+        // Drops an armed ramp, loop() arms a new one if enabled ///////////////
 
-        if                              (ledB < newB)
+        fadeRefresh                     ()                                      ;
+        return                          fastPath                                ;
+    }
+
+    if                                  (key == "breathe")
+    {
+        // Breathe between the current colour and a quarter of it, ms per ////
+        // way, played by DMA until the next command. 0 stops //////////////////
+
+        sceneStop                       ()                                      ;
+        colorStop                       ()                                      ;
+
+        if                              (value <= 0)
         {
-            ledB++                                                              ;
-            setPWM                      (pinB, ledB)                            ;
+            fadeStop                    (chR)                                   ;
+            return                      0                                       ;
         }
-        else if                         (ledB > newB)
+
+        uint16_t    low[]   =           { (uint16_t) (ledR / 4),
+                                          (uint16_t) (ledG / 4),
+                                          (uint16_t) (ledB / 4),
+                                          (uint16_t) (ledW / 4) }               ;
+
+        return                          fadeBreathe(low, value) ? value : -1    ;
+    }
+
+    if                                  (key == "pwmdither")
+    {
+        // Sigma-delta dither stage: 0 off, 1 on, 2 auto (fast PWM only) /////
+        // Returns the fraction bits in use ////////////////////////////////////
+
+        PwmChannel *ch[]    =           { &pwmR, &pwmG, &pwmB, &pwmW }          ;
+        uint8_t     bits    =           0                                       ;
+
+        for                             (uint8_t i = 0; i < 4; i++)
         {
-            ledB--                                                              ;
-            setPWM                      (pinB, ledB)                            ;
+            bits        =               pwmSetDither(ch[i]->timer(), value)     ;
         }
-        else { completed |= 0x4; }
 
-        // White Channel ///////////////////////////////////////////////////////
+        return                          bits                                    ;
+    }
 
-        if                              (ledW < newW)
+    if                                  (key == "luxlearn")
+    {
+        // Learn the self-light table (~15 s, the LEDs step through 8 levels //
+        // each), saved and the light restored when done ///////////////////////
+
+        PwmChannel *ch[]    =           { &pwmR, &pwmG, &pwmB, &pwmW }          ;
+
+        sceneStop                       ()                                      ;
+        colorStop                       ()                                      ;
+        ambientStop                     ()                                      ;
+
+        for                             (uint8_t i = 0; i < FADE_CHANNELS; i++)
         {
-            ledW++                                                              ;
-            setPWM                      (pinW, ledW)                            ;
+            fadeStop                    (i)                                     ;
         }
-        else if                         (ledW > newW)
+
+        if                              (!luxLearn(ch, 4))
         {
-            ledW--                                                              ;
-            setPWM                      (pinW, ledW)                            ;
+            return                      -1                                      ;
         }
-        else { completed |= 0x8; }
 
-        delay                           (delaytime)                             ;
+        luxLearned      =               false                                   ;
+        return                          0                                       ;
     }
 
-    #ifdef VERBOSE
-        Serial.print                    ("R: ")                                 ;
-        Serial.println                  (ledR)                                  ;
-        Serial.print                    ("G: ")                                 ;
-        Serial.println                  (ledG)                                  ;
-        Serial.print                    ("B: ")                                 ;
-        Serial.println                  (ledB)                                  ;
-        Serial.print                    ("W: ")                                 ;
-        Serial.println                  (ledW)                                  ;
-    #endif
-}
+    if                                  (key == "luxset")
+    {
+        // Day mode ambient light setpoint in lux //////////////////////////////
 
-uint16_t                readT6K         (void)
-{
-    uint16_t D          = analogRead    (pinAMB)                                ;
-    /*
-    float U             =               D * 3.3 / 4095.0                        ;
-    float I             =               U / 10000.0                             ;
-    uint16_t lux        =               I * 1000000 * 2                         ;
-    */
-    return                              (D * 0.161172)                          ;
-}
+        ambientSetpoint                 (value)                                 ;
+        return                          value                                   ;
+    }
 
-float                   readDS18B20     (void)
-{
-    float temp          =               0                                       ;
-    ds18b20.search                      ()                                      ;
-    temp                = ds18b20.      getTemperature()                        ;
-    ds18b20.resetsearch                 ()                                      ;
-    return                              temp                                    ;
-}
+    if                                  (key == "luxpi")
+    {
+        // "luxpi=<kp>,<ki>" controller gains, Q8 (256 = 1 level per lux) //////
 
-void                    motionISR       (void)
-{
-    // Set motion state bit (2) ////////////////////////////////////////////////
+        int     comma   =               cmd.indexOf(',', sep + 1)               ;
+
+        if                              (comma < 0)
+        {
+            return                      -1                                      ;
+        }
 
-    state              |=               0x2                                     ;
+        ambientGains                    (cmd.substring(sep + 1, comma).toInt(),
+                                         cmd.substring(comma + 1).toInt())      ;
+        return                          0                                       ;
+    }
 
-    RGB.control                         (true)                                  ;
-    RGB.color                           (30, 255, 5)                            ;
+    if                                  (key == "pirfilter")
+    {
+        // "pirfilter=<ms>,<n>,<ms>" shortest PIR pulse, then N pulses within //
+        // the window before it's motion (1: every pulse that's long enough) ///
+
+        int     comma1  =               cmd.indexOf(',', sep + 1)               ;
+        int     comma2  =               cmd.indexOf(',', comma1 + 1)            ;
+
+        if                              (comma1 < 0 || comma2 < 0)
+        {
+            return                      -1                                      ;
+        }
+
+        int     n       =               cmd.substring(comma1 + 1, comma2).toInt();
+        boolean ok      =               pirFilter(value, n,
+                                         cmd.substring(comma2 + 1).toInt())     ;
+
+        return                          ok ? 0 : -1                             ;
+    }
+
+    if                                  (key == "luxrate")
+    {
+        // Largest correction in levels per second (65535: full range) /////////
+
+        ambientRate                     (value)                                 ;
+        return                          value                                   ;
+    }
+
+    return                              -1                                      ;
 }
 
-void                    alertESR        (const char *event, const char *data)
+int                     sceneCmd        (String cmd)
 {
-    // Set event notification state bit (16) ///////////////////////////////////
+    #ifdef VERBOSE
+        Serial.print                    ("scene Called: ")                      ;
+        Serial.println                  (cmd)                                   ;
+    #endif
+
+    // "def <slot>[,loop]"  starts (re)defining a user scene ///////////////////
+    // "add <slot>,<RRGGBBWW hex>,<ms>[,<ease>[,<flags>]]"  appends a keyframe /
+    // "play <slot>", "stop" ///////////////////////////////////////////////////
+
+    int     sp          =               cmd.indexOf(' ')                        ;
+    String  verb        =               (sp < 0) ? cmd : cmd.substring(0, sp)   ;
+    String  args        =               (sp < 0) ? "" : cmd.substring(sp + 1)   ;
+    String  arg[5]                                                              ;
+
+    for                                 (uint8_t i = 0, pos = 0;
+                                         i < 5 && pos <= args.length(); i++)
+    {
+        int comma       =               args.indexOf(',', pos)                  ;
+        comma           =               (comma < 0) ? args.length() : comma     ;
+        arg[i]          =               args.substring(pos, comma)              ;
+        pos             =               comma + 1                               ;
+    }
+
+    uint8_t slot        =               arg[0].toInt()                          ;
+
+    if                                  (verb == "stop")
+    {
+        sceneStop                       ()                                      ;
+        return                          0                                       ;
+    }
+
+    if                                  (verb == "def")
+    {
+        return                          sceneDefine(slot,
+                                            arg[1] == "loop" ? SCENE_LOOP : 0)  ;
+    }
+
+    if                                  (verb == "add")
+    {
+        uint32_t rgbw   =               strtoul(arg[1].c_str(), NULL, 16)       ;
+        uint8_t  ease   =               arg[3].length() ? arg[3].toInt()
+                                                        : EASE_LINEAR           ;
+        uint8_t  flags  =               arg[4].length() ? arg[4].toInt()
+                                                        : KF_RGBW               ;
+        long     ms     =               arg[2].toInt()                          ;
+
+        // Keyframe durations are 16 bit, don't let 70000 wrap to 4464 /////////
+
+        if                              (ms < 1 || ms > 65535)
+        {
+            return                      -1                                      ;
+        }
+
+        return                          sceneAppend(slot, keyframe(rgbw,
+                                            ms, ease, flags))                   ;
+    }
+
+    if                                  (verb == "play")
+    {
+        const Scene *s  =               sceneUser(slot)                         ;
+
+        if                              (s == NULL)
+        {
+            return                      -1                                      ;
+        }
+
+        ambientStop                     ()                                      ;
+        colorStop                       ()                                      ;
+        scenePlay                       (s)                                     ;
+        return                          s->count                                ;
+    }
 
-    state              |=               0x16                                    ;
+    return                              -1                                      ;
+}
 
+int                     calibCmd        (String cmd)
+{
     #ifdef VERBOSE
-        Serial.print                    (" -> Event Received: ")                ;
-        Serial.println                  (data)                                  ;
+        Serial.print                    ("calib Called: ")                      ;
+        Serial.println                  (cmd)                                   ;
     #endif
 
-    //FIXME: Well, do something with it
-    //setPWM                              (pinB, 255)                            ;
+    // "row <out>,<r>,<g>,<b>,<w>"  matrix row, Q12 (4096 = 1.0, max +-2.0) ///
+    // "max <r>,<g>,<b>,<w>"  per channel maximum (65535 = full current) ///////
+    // "save", "load", "reset" (identity, not saved) ///////////////////////////
+    // Changes show right away, only "save" makes them survive a reset /////////
+
+    int     sp          =               cmd.indexOf(' ')                        ;
+    String  verb        =               (sp < 0) ? cmd : cmd.substring(0, sp)   ;
+    String  args        =               (sp < 0) ? "" : cmd.substring(sp + 1)   ;
+    long    arg[5]      =               { 0, 0, 0, 0, 0 }                       ;
+    uint8_t n           =               0                                       ;
+
+    for                                 (uint8_t pos = 0;
+                                         n < 5 && pos < args.length(); n++)
+    {
+        int comma       =               args.indexOf(',', pos)                  ;
+        comma           =               (comma < 0) ? args.length() : comma     ;
+        arg[n]          =               args.substring(pos, comma).toInt()      ;
+        pos             =               comma + 1                               ;
+    }
+
+    if                                  (verb == "row" && n == 5)
+    {
+        int16_t coef[]  =               { (int16_t) arg[1], (int16_t) arg[2],
+                                          (int16_t) arg[3], (int16_t) arg[4] }  ;
+
+        if                              (!calibSetRow(arg[0], coef))
+        {
+            return                      -1                                      ;
+        }
+    }
+    else if                             (verb == "max" && n == 4)
+    {
+        uint16_t max[]  =               { (uint16_t) arg[0], (uint16_t) arg[1],
+                                          (uint16_t) arg[2], (uint16_t) arg[3] };
+
+        calibSetMax                     (max)                                   ;
+    }
+    else if                             (verb == "save")
+    {
+        calibSave                       ()                                      ;
+        return                          0                                       ;
+    }
+    else if                             (verb == "load")
+    {
+        if                              (!calibLoad())
+        {
+            return                      -1                                      ;
+        }
+    }
+    else if                             (verb == "reset")
+    {
+        calibReset                      ()                                      ;
+    }
+    else
+    {
+        return                          -1                                      ;
+    }
+
+    fadeRefresh                         ()                                      ;
+    return                              0                                       ;
 }
 
 int                     setRGBW         (String rgbwInt)
@@ -571,6 +1170,34 @@ int                     setRGBW         (String rgbwInt)
         Serial.print                    ("setRGBW Called: ")                    ;
         Serial.println                  (rgbwInt)                               ;
     #endif
-    fadeTo                              (rgbwInt.toInt(), 20)                   ;
+
+    // "<rgbw>" steps every channel by 1 per 20ms, "<rgbw>,<ms>" fades all ///
+    // channels in sync over the given duration, "<rgbw>,<ms>,hsv|lab" takes ///
+    // the hue arc through HSV or OKLab and puts the white part on W ///////////
+
+    int     sep         =               rgbwInt.indexOf(',')                    ;
+    int     sep2        =               rgbwInt.indexOf(',', sep + 1)           ;
+
+    if                                  (sep < 0)
+    {
+        fadeTo                          (rgbwInt.toInt(), 20)                   ;
+    }
+    else if                             (sep2 < 0)
+    {
+        fadeToSync                      (rgbwInt.substring(0, sep).toInt(),
+                                         rgbwInt.substring(sep + 1).toInt())    ;
+    }
+    else
+    {
+        String  mode    =               rgbwInt.substring(sep2 + 1)             ;
+        uint8_t space   =               (mode == "hsv") ? COLOR_HSV
+                                      : (mode == "lab") ? COLOR_OKLCH
+                                      :                   COLOR_RGB             ;
+
+        fadeToSync                      (rgbwInt.substring(0, sep).toInt(),
+                                         rgbwInt.substring(sep + 1, sep2).toInt(),
+                                         space)                                 ;
+    }
+
     return                              1                                       ;
 }
@@ -1,29 +1,780 @@
 // https://github.com/krvarma/Dallas_DS18B20_SparkCore
 
+#ifndef DS18B20_h
+#define DS18B20_h
+
 #include "OneWire.h"
 #include "application.h"
 
 #define MAX_NAME 8
 
-class DS18B20
+// Worst case conversion time (12 bit / DS18S20) in milliseconds
+#define DS18B20_CONV_MAX 750
+
+// update() starts a conversion at most this often (start to start). Back to
+// back conversions would self-heat the probe and flood whoever listens
+#ifndef DS18B20_PERIOD_MS
+#define DS18B20_PERIOD_MS 2000
+#endif
+
+// Size of the cached ROM table (sensors handled on one bus)
+#ifndef DS18B20_MAX_DEVICES
+#define DS18B20_MAX_DEVICES 4
+#endif
+
+// Consecutive calm readings before adaptive mode drops back to 9 bit
+#ifndef DS18B20_STABLE_READS
+#define DS18B20_STABLE_READS 8
+#endif
+
+// Adaptive mode measures the rate against the last reading that moved, at
+// most this long ago; a single LSB step only counts once it has held this long
+#ifndef DS18B20_RATE_WINDOW_MS
+#define DS18B20_RATE_WINDOW_MS 60000
+#endif
+
+// Extra attempts for a ROM search or scratchpad read that fails its CRC
+#ifndef DS18B20_RETRIES
+#define DS18B20_RETRIES 3
+#endif
+
+// Steps of a scratchpad read driven by update()
+#define DS18B20_FETCH_IDLE      0
+#define DS18B20_FETCH_COMMAND   1   // Match ROM + Read Scratchpad on the bus
+#define DS18B20_FETCH_DATA      2   // 9 bytes coming back
+
+// Sensor logic, templated on the 1-Wire bus type. The bus is a member, so
+// nothing is heap allocated and a StaticOneWire bus inlines all the way
+// down to the GPIO registers.
+
+template <class Bus>
+class DS18B20Bus
 {
     private:
 
-        OneWire*    ds                                                          ;
+        Bus         ds                                                          ;
         byte        data[12]                                                    ;
         byte        addr[8]                                                     ;
         byte        type_s                                                      ;
         byte        chiptype                                                    ;
         char        szName[MAX_NAME]                                            ;
+        boolean     parasite                                                    ;
+        boolean     converting                                                  ;
+        uint32_t    convStart                                                   ;
+        uint16_t    convTime                                                    ;
+
+        // Cached bus enumeration
+        byte        rom[DS18B20_MAX_DEVICES][8]                                 ;
+        byte        config[DS18B20_MAX_DEVICES]                                 ;
+        float       temperature[DS18B20_MAX_DEVICES]                            ;
+        uint8_t     devices                                                     ;
+        uint8_t     reading                                                     ;
+
+        // Adaptive resolution
+        float       previous[DS18B20_MAX_DEVICES]                               ;
+        uint32_t    since[DS18B20_MAX_DEVICES]                                  ;
+        uint8_t     stable[DS18B20_MAX_DEVICES]                                 ;
+        float       threshold                                                   ;
+
+        // Bus error statistics
+        uint32_t    crcErrors                                                   ;
+        uint32_t    failures                                                    ;
+
+        // Scratchpad read in progress
+        uint8_t     phase                                                       ;
+        uint8_t     attempt                                                     ;
+        boolean     fetched                                                     ;
+
+        boolean     scan                ()                                      ;
+        boolean     fetch               (uint8_t index)                         ;
+        boolean     fetchStep           (uint8_t index)                         ;
+        void        abandon             ()                                      ;
+        void        store               (uint8_t index)                         ;
+        float       decode              (uint8_t index)                         ;
+        void        adapt               (uint8_t index)                         ;
+        void        begin               ()                                      ;
 
     public:
 
-        DS18B20                         (uint16_t pin)                          ;
+        DS18B20Bus                      ()                                      ;
+        DS18B20Bus                      (uint16_t pin)                          ;
         boolean     search              ()                                      ;
         void        resetsearch         ()                                      ;
         void        getROM              (char szROM[])                          ;
+        void        getROM              (uint8_t index, char szROM[])           ;
         byte        getChipType         ()                                      ;
         char*       getChipName         ()                                      ;
         char*       getID               ()                                      ;
-        float       getTemperature      ()                                      ;
+        float       getTemperature      (uint8_t index = 0)                     ;
+
+        // Walk the bus once and cache up to DS18B20_MAX_DEVICES ROM codes.
+        // Call at boot and whenever probes are added or removed; returns the
+        // number of devices found.
+
+        uint8_t     enumerate           ()                                      ;
+        uint8_t     getDeviceCount      ()                                      ;
+
+        // Non-blocking conversion pipeline. startConversion() broadcasts
+        // Convert T to all sensors (Skip ROM) and returns immediately,
+        // isConversionDone() polls the read slot (or the resolution based
+        // deadline for parasite powered buses) and readScratchpad() fetches
+        // and decodes the result of one cached device.
+
+        boolean     startConversion     ()                                      ;
+        boolean     isConversionDone    ()                                      ;
+        boolean     readScratchpad      (uint8_t index)                         ;
+        uint16_t    conversionTime      ()                                      ;
+
+        // Drive the pipeline from loop(), one conversion every
+        // DS18B20_PERIOD_MS, reading one scratchpad at a time.
+        // Each call only starts or collects a bus transfer, on the USART
+        // backend the slots run by DMA in between. Returns true once all
+        // devices of a conversion have been read and lastTemperature()
+        // holds fresh values.
+
+        boolean     update              ()                                      ;
+        float       lastTemperature     (uint8_t index = 0)                     ;
+
+        // Write the configuration register (9-12 bit) through Write
+        // Scratchpad, keeping the alarm bytes. With persist set, Copy
+        // Scratchpad stores it in the device EEPROM (blocks ~10ms, limited
+        // write endurance, so don't use it for adaptive changes). An index
+        // past the enumerated devices fails, getResolution() returns 0.
+
+        boolean     setResolution       (uint8_t index, uint8_t bits,
+                                         boolean persist = false)               ;
+        uint8_t     getResolution       (uint8_t index)                         ;
+
+        // Adaptive mode: raise resolution one step whenever a probe changes
+        // faster than threshold (degC per minute, measured since the last
+        // reading that moved, see DS18B20_RATE_WINDOW_MS), drop back to 9
+        // bit after DS18B20_STABLE_READS calm readings spanning a whole
+        // window. A threshold <= 0 disables it.
+
+        void        setAdaptive         (float threshold)                       ;
+
+        // CRC mismatches seen on ROM searches and scratchpad reads (each one
+        // is retried), and reads that still failed after DS18B20_RETRIES.
+
+        uint32_t    getCrcErrors        ()                                      ;
+        uint32_t    getFailures         ()                                      ;
+};
+
+// Pin bound at compile time, e.g. StaticDS18B20<OneWirePinD4>
+template <class Pin>
+class StaticDS18B20 : public DS18B20Bus< StaticOneWire<Pin> >
+{
+};
+
+// Pin chosen at run time
+class DS18B20 : public DS18B20Bus<OneWire>
+{
+    public:
+
+        DS18B20                         (uint16_t pin)
+                                        : DS18B20Bus<OneWire>(pin)              {}
 };
+
+////////////////////////////////////////////////////////////////////////////////
+// Template implementation
+
+template <class Bus>
+DS18B20Bus<Bus>::DS18B20Bus()
+{
+    begin();
+}
+
+template <class Bus>
+DS18B20Bus<Bus>::DS18B20Bus(uint16_t pin) : ds(pin)
+{
+    begin();
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::begin()
+{
+    type_s = 0;
+    parasite = false;
+    converting = false;
+    convStart = 0;
+    convTime = DS18B20_CONV_MAX;
+    devices = 0;
+    reading = 0;
+    threshold = 0;
+    crcErrors = 0;
+    failures = 0;
+    phase = DS18B20_FETCH_IDLE;
+    attempt = 0;
+    fetched = false;
+
+    for (uint8_t i = 0; i < DS18B20_MAX_DEVICES; i++)
+    {
+        config[i] = 0x60;   // assume 12 bit until the first scratchpad read
+        temperature[i] = 0;
+        previous[i] = 0;
+        since[i] = 0;
+        stable[i] = 0;
+    }
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::search()
+{
+    boolean isSuccess =  ds.search(addr);
+
+    if(isSuccess)
+    {
+        chiptype = addr[0];
+
+        switch (addr[0])
+        {
+            case 0x10:      sprintf(szName, "DS18S20");     type_s = 1;     break;
+            case 0x28:      sprintf(szName, "DS18B20");     type_s = 0;     break;
+            case 0x22:      sprintf(szName, "DS1822");      type_s = 0;     break;
+            default:        sprintf(szName, "Unknown");     type_s = 0;     break;
+        }
+    }
+
+    return isSuccess;
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::resetsearch()
+{
+    ds.reset_search();
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::getROM(char szROM[])
+{
+    sprintf(szROM, "%X %X %X %X %X %X %X %X", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5], addr[6], addr[7]);
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::getROM(uint8_t index, char szROM[])
+{
+    byte *r = rom[index];
+
+    sprintf(szROM, "%X %X %X %X %X %X %X %X", r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+}
+
+template <class Bus>
+byte DS18B20Bus<Bus>::getChipType()
+{
+    return chiptype;
+}
+
+template <class Bus>
+char* DS18B20Bus<Bus>::getChipName()
+{
+    return szName;
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::scan()
+{
+    boolean valid = true;
+
+    devices = 0;
+
+    resetsearch();
+
+    while (devices < DS18B20_MAX_DEVICES && search())
+    {
+        // A corrupted bit sends the search down a wrong branch
+        if (OneWireBase::crc8(addr, 7) != addr[7])
+        {
+            crcErrors++;
+            valid = false;
+            break;
+        }
+
+        // Only keep temperature sensors
+        if (addr[0] != 0x10 && addr[0] != 0x28 && addr[0] != 0x22)
+        {
+            continue;
+        }
+
+        memcpy(rom[devices], addr, 8);
+        config[devices] = 0x60;
+        stable[devices] = 0;
+        devices++;
+    }
+
+    resetsearch();
+
+    return valid;
+}
+
+template <class Bus>
+uint8_t DS18B20Bus<Bus>::enumerate()
+{
+    abandon();
+
+    reading = 0;
+    converting = false;
+
+    uint8_t attempt = 0;
+
+    while (!scan())
+    {
+        if (attempt++ == DS18B20_RETRIES)
+        {
+            failures++;
+            devices = 0;
+            return 0;
+        }
+    }
+
+    // Read Power Supply: any parasite powered device pulls the slot low
+    parasite = false;
+
+    if (devices && ds.reset())
+    {
+        ds.skip();
+        ds.write(0xB4);
+        parasite = !ds.read_bit();
+    }
+
+    return devices;
+}
+
+template <class Bus>
+uint8_t DS18B20Bus<Bus>::getDeviceCount()
+{
+    return devices;
+}
+
+template <class Bus>
+float DS18B20Bus<Bus>::getTemperature(uint8_t index)
+{
+    // Blocking variant, kept for simple sketches
+    if (index >= devices || !startConversion())
+    {
+        return temperature[index % DS18B20_MAX_DEVICES];
+    }
+
+    delay(convTime);
+    readScratchpad(index);
+
+    return temperature[index];
+}
+
+template <class Bus>
+uint16_t DS18B20Bus<Bus>::conversionTime()
+{
+    uint16_t t = 0;
+
+    // A broadcast conversion lasts as long as the slowest device
+    for (uint8_t i = 0; i < devices; i++)
+    {
+        uint16_t dt;
+
+        if (rom[i][0] == 0x10)
+        {
+            dt = DS18B20_CONV_MAX;
+        }
+        else switch (config[i] & 0x60)
+        {
+            case 0x00:  dt = 94;    break;  // 9 bit resolution, 93.75 ms
+            case 0x20:  dt = 188;   break;  // 10 bit res, 187.5 ms
+            case 0x40:  dt = 375;   break;  // 11 bit res, 375 ms
+            default:    dt = DS18B20_CONV_MAX;  break;
+        }
+
+        if (dt > t)
+        {
+            t = dt;
+        }
+    }
+
+    return t;
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::startConversion()
+{
+    abandon();
+
+    if (!devices || !ds.reset())
+    {
+        return false;
+    }
+
+    ds.skip();
+    ds.write(0x44, parasite);  // start conversion on all devices at once
+
+    convStart = millis();
+    convTime = conversionTime();
+    converting = true;
+    reading = 0;
+
+    return true;
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::isConversionDone()
+{
+    if (!converting)
+    {
+        return true;
+    }
+
+    if (millis() - convStart >= convTime)
+    {
+        return true;
+    }
+
+    // Externally powered devices answer read slots with 0 while converting,
+    // the bus reads 1 once the last of them is done. Parasite powered ones
+    // need the strong pull-up, so leave the bus alone.
+    if (!parasite && ds.read_bit())
+    {
+        return true;
+    }
+
+    return false;
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::abandon()
+{
+    // A blocking call needs the bus, drop the read update() is in the middle
+    // of, it starts over on the next call
+    if (phase != DS18B20_FETCH_IDLE)
+    {
+        ds.finish();
+        phase = DS18B20_FETCH_IDLE;
+    }
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::fetchStep(uint8_t index)
+{
+    if (ds.busy())
+    {
+        return false;
+    }
+
+    switch (phase)
+    {
+        case DS18B20_FETCH_COMMAND:
+
+            if (ds.finish())
+            {
+                ds.read_start(9);   // we need 9 bytes
+                phase = DS18B20_FETCH_DATA;
+                return false;
+            }
+
+            break;
+
+        case DS18B20_FETCH_DATA:
+
+            // A line stuck low reads as all zeros with a valid CRC, the low
+            // bits of the config byte are always set though.
+            if (ds.finish(data) && OneWireBase::crc8(data, 8) == data[8] &&
+                (data[4] & 0x1F) == 0x1F)
+            {
+                phase = DS18B20_FETCH_IDLE;
+                fetched = true;
+                return true;
+            }
+
+            crcErrors++;
+            break;
+
+        default:
+
+            attempt = 0;
+            break;
+    }
+
+    // First attempt or a retry
+    while (attempt <= DS18B20_RETRIES)
+    {
+        attempt++;
+
+        if (ds.reset())
+        {
+            byte cmd[10];
+
+            cmd[0] = 0x55;          // Match ROM
+            memcpy(cmd + 1, rom[index], 8);
+            cmd[9] = 0xBE;          // Read Scratchpad
+
+            ds.write_start(cmd, 10);
+            phase = DS18B20_FETCH_COMMAND;
+            return false;
+        }
+    }
+
+    failures++;
+
+    phase = DS18B20_FETCH_IDLE;
+    fetched = false;
+
+    return true;
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::fetch(uint8_t index)
+{
+    if (index >= devices)
+    {
+        return false;
+    }
+
+    abandon();
+
+    while (!fetchStep(index));
+
+    return fetched;
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::store(uint8_t index)
+{
+    config[index] = data[4];
+    temperature[index] = decode(index);
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::readScratchpad(uint8_t index)
+{
+    if (!fetch(index))
+    {
+        return false;
+    }
+
+    store(index);
+
+    return true;
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::update()
+{
+    if (!devices)
+    {
+        return false;
+    }
+
+    if (!converting)
+    {
+        if (millis() - convStart >= DS18B20_PERIOD_MS)
+        {
+            startConversion();
+        }
+
+        return false;
+    }
+
+    if (reading == 0 && phase == DS18B20_FETCH_IDLE && !isConversionDone())
+    {
+        return false;
+    }
+
+    // Spread the scratchpad reads over consecutive calls
+    if (!fetchStep(reading))
+    {
+        return false;
+    }
+
+    if (fetched)
+    {
+        store(reading);
+
+        if (threshold > 0)
+        {
+            adapt(reading);
+        }
+    }
+
+    reading++;
+
+    if (reading < devices)
+    {
+        return false;
+    }
+
+    converting = false;
+    reading = 0;
+
+    return true;
+}
+
+template <class Bus>
+float DS18B20Bus<Bus>::lastTemperature(uint8_t index)
+{
+    return temperature[index % DS18B20_MAX_DEVICES];
+}
+
+template <class Bus>
+boolean DS18B20Bus<Bus>::setResolution(uint8_t index, uint8_t bits, boolean persist)
+{
+    // DS18S20 has a fixed 9 bit register (extended via count remain)
+    if (index >= devices || rom[index][0] == 0x10 || bits < 9 || bits > 12)
+    {
+        return false;
+    }
+
+    // Keep the current TH/TL alarm bytes
+    if (!fetch(index))
+    {
+        return false;
+    }
+
+    byte cfg = ((bits - 9) << 5) | 0x1F;
+    byte cmd[4] = { 0x4E, data[2], data[3], cfg };  // Write Scratchpad
+
+    if (!ds.reset())
+    {
+        return false;
+    }
+
+    ds.select(rom[index]);
+
+    if (!ds.write_bytes(cmd, 4))
+    {
+        return false;
+    }
+
+    config[index] = cfg;
+
+    if (persist)
+    {
+        ds.reset();
+        ds.select(rom[index]);
+        ds.write(0x48, parasite);  // Copy Scratchpad
+        delay(10);
+        ds.depower();
+    }
+
+    return true;
+}
+
+template <class Bus>
+uint8_t DS18B20Bus<Bus>::getResolution(uint8_t index)
+{
+    if (index >= devices)
+    {
+        return 0;
+    }
+
+    if (rom[index][0] == 0x10)
+    {
+        return 9;
+    }
+
+    return 9 + ((config[index] >> 5) & 0x03);
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::setAdaptive(float threshold)
+{
+    this->threshold = threshold;
+
+    for (uint8_t i = 0; i < devices; i++)
+    {
+        previous[i] = temperature[i];
+        since[i] = millis();
+        stable[i] = 0;
+    }
+}
+
+template <class Bus>
+uint32_t DS18B20Bus<Bus>::getCrcErrors()
+{
+    return crcErrors;
+}
+
+template <class Bus>
+uint32_t DS18B20Bus<Bus>::getFailures()
+{
+    return failures;
+}
+
+template <class Bus>
+void DS18B20Bus<Bus>::adapt(uint8_t index)
+{
+    uint32_t elapsed = millis() - since[index];
+    float delta = temperature[index] - previous[index];
+
+    if (delta < 0)
+    {
+        delta = -delta;
+    }
+
+    uint8_t bits = getResolution(index);
+    float lsb = 0.5 / (1 << (bits - 9));
+
+    // Compare with the last reading that moved, not the one before: back
+    // to back conversions are ~100ms apart and a real drift shows up as one
+    // LSB every few seconds. A single LSB flip is quantization noise unless
+    // it has held for the whole window.
+    boolean moved = delta > lsb ||
+                    (delta > 0 && elapsed >= DS18B20_RATE_WINDOW_MS);
+
+    // Restart the reference after a move, or after a window without one so
+    // a sudden change isn't averaged over hours of calm
+    if (moved || elapsed >= DS18B20_RATE_WINDOW_MS)
+    {
+        previous[index] = temperature[index];
+        since[index] = millis();
+    }
+
+    // Rate of change in degC per minute since that reading
+    if (moved && elapsed && delta * 60000.0 / elapsed > threshold)
+    {
+        stable[index] = 0;
+
+        if (bits < 12)
+        {
+            setResolution(index, bits + 1);
+        }
+    }
+    else if (stable[index] < DS18B20_STABLE_READS)
+    {
+        stable[index]++;
+    }
+    else if (bits > 9 && elapsed >= DS18B20_RATE_WINDOW_MS)
+    {
+        // Calm for the reads and for a whole window: a slow drift takes
+        // longer than a few reads to show at the higher resolution
+        setResolution(index, 9);
+    }
+}
+
+template <class Bus>
+float DS18B20Bus<Bus>::decode(uint8_t index)
+{
+    // Convert the data to actual temperature
+    // because the result is a 16 bit signed integer, it should
+    // be stored to an "int16_t" type, which is always 16 bits
+    // even when compiled on a 32 bit processor.
+    int16_t raw = (data[1] << 8) | data[0];
+
+    if (rom[index][0] == 0x10)
+    {
+        raw = raw << 3; // 9 bit resolution default
+        if (data[7] == 0x10)
+        {
+            // "count remain" gives full 12 bit resolution
+            raw = (raw & 0xFFF0) + 12 - data[6];
+        }
+    }
+    else
+    {
+        byte cfg = (data[4] & 0x60);
+        // at lower res, the low bits are undefined, so let's zero them
+        if (cfg == 0x00) raw = raw & ~7;  // 9 bit resolution, 93.75 ms
+        else if (cfg == 0x20) raw = raw & ~3; // 10 bit res, 187.5 ms
+        else if (cfg == 0x40) raw = raw & ~1; // 11 bit res, 375 ms
+        //// default is 12 bit resolution, 750 ms conversion time
+    }
+
+    return (float)raw / 16.0;
+}
+
+#endif
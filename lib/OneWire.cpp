@@ -5,423 +5,332 @@
 #include "OneWire.h"
 #include "application.h"
 
-OneWire::OneWire(uint16_t pin){
-    pinMode(pin, INPUT);
-
-    _pin = pin;
+OneWireRuntimePin::OneWireRuntimePin(uint16_t pin){
+    pinMode(pin, INPUT);    // enables the port clock once
+
+    // Resolve everything the bit slots need up front, so switching the
+    // direction is a single read-modify-write of the CRL/CRH nibble.
+    GPIO_TypeDef *gpio_port = PIN_MAP[pin].gpio_peripheral;
+    uint16_t gpio_pin = PIN_MAP[pin].gpio_pin;
+    uint8_t pos = 0;
+
+    while (!(gpio_pin & (1 << pos))) pos++;
+
+    _cr = (pos < 8) ? &gpio_port->CRL : &gpio_port->CRH;
+    uint8_t shift = (pos & 7) * 4;
+
+    _crMask = 0xFUL << shift;
+    _crOutput = 0x3UL << shift;     // MODE=11 (50MHz), CNF=00 push-pull
+    _crInput = 0x4UL << shift;      // MODE=00, CNF=01 floating input
+    _bsrr = &gpio_port->BSRR;
+    _brr = &gpio_port->BRR;
+    _idr = &gpio_port->IDR;
+    _bitmask = gpio_pin;
 }
 
-void OneWire::DIRECT_WRITE_LOW(void){
-    PIN_MAP[_pin].gpio_peripheral->BRR = PIN_MAP[_pin].gpio_pin;
-}
+#if ONEWIRE_USART
 
-void OneWire::DIRECT_MODE_OUTPUT(void){
-    GPIO_TypeDef *gpio_port = PIN_MAP[_pin].gpio_peripheral;
-    uint16_t gpio_pin = PIN_MAP[_pin].gpio_pin;
+// USART backend: every 1-Wire time slot is one UART frame on the half-duplex
+// TX line. At 115200 baud a frame is 86.8us, the start bit alone (8.7us low)
+// forms a write-1/read slot (0xFF), all data bits low form a write-0 slot
+// (0x00). A slave answering 0 stretches the low phase, so any echo other
+// than 0xFF reads as 0. The reset pulse is 0xF0 at 9600 baud (520us low),
+// a presence pulse corrupts the echoed high nibble.
 
+OneWireUsart::OneWireUsart(uint16_t pin){
     GPIO_InitTypeDef GPIO_InitStructure;
 
-    if (gpio_port == GPIOA ){
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA, ENABLE);
-    }
-    else if (gpio_port == GPIOB ){
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB, ENABLE);
-    }
-
-    GPIO_InitStructure.GPIO_Pin = gpio_pin;
-    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_Out_PP;
-    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
-    PIN_MAP[_pin].pin_mode = OUTPUT;
+    _pin = pin;     // must be TX, see ONEWIRE_USART in OneWire.h
+    _active = 0;
+    _reading = 0;
 
-    GPIO_Init(gpio_port, &GPIO_InitStructure);
-}
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA | RCC_APB2Periph_AFIO, ENABLE);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, ENABLE);
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
 
-void OneWire::DIRECT_WRITE_HIGH(void){
-    PIN_MAP[_pin].gpio_peripheral->BSRR = PIN_MAP[_pin].gpio_pin;
+    GPIO_InitStructure.GPIO_Pin = PIN_MAP[pin].gpio_pin;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_OD;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_Init(PIN_MAP[pin].gpio_peripheral, &GPIO_InitStructure);
+    PIN_MAP[pin].pin_mode = AF_OUTPUT_DRAIN;
+
+    // 8N1, single wire half-duplex, both directions served by DMA
+    USART2->CR1 = 0;
+    USART2->CR2 = 0;
+    USART2->CR3 = USART_CR3_HDSEL | USART_CR3_DMAT | USART_CR3_DMAR;
+    baud(115200);
+    USART2->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+
+    // DMA1 Channel6 = USART2_RX, Channel7 = USART2_TX
+    DMA1_Channel6->CPAR = (uint32_t) &USART2->DR;
+    DMA1_Channel7->CPAR = (uint32_t) &USART2->DR;
 }
 
-void OneWire::DIRECT_MODE_INPUT(void){
-    GPIO_TypeDef *gpio_port = PIN_MAP[_pin].gpio_peripheral;
-    uint16_t gpio_pin = PIN_MAP[_pin].gpio_pin;
-
-    GPIO_InitTypeDef GPIO_InitStructure;
-
-    if (gpio_port == GPIOA ){
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA, ENABLE);
-    }
-    else if (gpio_port == GPIOB ){
-        RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB, ENABLE);
-    }
+void OneWireUsart::baud(uint32_t rate){
+    // USART2 hangs off APB1 (HCLK/2)
+    while (!(USART2->SR & USART_SR_TC));
 
-    GPIO_InitStructure.GPIO_Pin = gpio_pin;
-    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN_FLOATING;
-    PIN_MAP[_pin].pin_mode = INPUT;
+    USART2->BRR = ((SystemCoreClock / 2) + rate / 2) / rate;
+}
 
-    GPIO_Init(gpio_port, &GPIO_InitStructure);
+//
+// Send count slot frames and overwrite them in place with the echo. Only
+// starts the DMA, busy() and complete() follow it up.
+//
+void OneWireUsart::start(uint8_t *slots, uint16_t count){
+    // 87us per frame, allow twice that before giving up
+    _timeout = (uint32_t) count * 174 + 100;
+    _started = micros();
+    _active = 1;
+
+    // drop a stale echo
+    (void) USART2->SR;
+    (void) USART2->DR;
+
+    DMA1->IFCR = DMA_IFCR_CGIF6 | DMA_IFCR_CGIF7;
+
+    DMA1_Channel6->CCR = 0;
+    DMA1_Channel6->CMAR = (uint32_t) slots;
+    DMA1_Channel6->CNDTR = count;
+    DMA1_Channel6->CCR = DMA_CCR1_MINC | DMA_CCR1_PL_1 | DMA_CCR1_EN;
+
+    DMA1_Channel7->CCR = 0;
+    DMA1_Channel7->CMAR = (uint32_t) slots;
+    DMA1_Channel7->CNDTR = count;
+    DMA1_Channel7->CCR = DMA_CCR1_MINC | DMA_CCR1_DIR | DMA_CCR1_EN;
 }
 
-uint8_t OneWire::DIRECT_READ(void){
-    return GPIO_ReadInputDataBit(PIN_MAP[_pin].gpio_peripheral, PIN_MAP[_pin].gpio_pin);
+//
+// 1 while the last echo frame hasn't arrived and the timeout hasn't run out.
+//
+uint8_t OneWireUsart::busy(void){
+    return _active && !(DMA1->ISR & DMA_ISR_TCIF6) &&
+           micros() - _started <= _timeout;
 }
 
-// Perform the onewire reset function.  We will wait up to 250uS for
-// the bus to come high, if it doesn't then it is broken or shorted
-// and we return a 0;
 //
-// Returns 1 if a device asserted a presence pulse, 0 otherwise.
+// Wait out the transfer (at once if busy() already said so) and release the
+// channels. Returns 0 on a stuck transfer.
 //
-uint8_t OneWire::reset(void){
+uint8_t OneWireUsart::complete(void){
     uint8_t r;
-    uint8_t retries = 125;
-
-    noInterrupts();
-    DIRECT_MODE_INPUT();
-    interrupts();
-    // wait until the wire is high... just in case
-    do {
-        if (--retries == 0) return 0;
-
-        delayMicroseconds(2);
-    } while ( !DIRECT_READ());
-
-    noInterrupts();
-
-    DIRECT_WRITE_LOW();
-    DIRECT_MODE_OUTPUT();   // drive output low
-
-    interrupts();
-    delayMicroseconds(480);
-    noInterrupts();
 
-    DIRECT_MODE_INPUT();    // allow it to float
+    while (busy());
 
-    delayMicroseconds(70);
+    r = _active && (DMA1->ISR & DMA_ISR_TCIF6);
 
-    r =! DIRECT_READ();
+    DMA1_Channel6->CCR = 0;
+    DMA1_Channel7->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF6 | DMA_IFCR_CGIF7;
 
-    interrupts();
-
-    delayMicroseconds(410);
+    _active = 0;
 
     return r;
 }
 
-void OneWire::write_bit(uint8_t v){
-    if (v & 1) {
-        noInterrupts();
-
-        DIRECT_WRITE_LOW();
-        DIRECT_MODE_OUTPUT();   // drive output low
-
-        delayMicroseconds(10);
-
-        DIRECT_WRITE_HIGH();    // drive output high
-
-        interrupts();
-
-        delayMicroseconds(55);
-    } else {
-        noInterrupts();
-
-        DIRECT_WRITE_LOW();
-        DIRECT_MODE_OUTPUT();   // drive output low
-
-        delayMicroseconds(65);
-
-        DIRECT_WRITE_HIGH();    // drive output high
-
-        interrupts();
+//
+// Blocking transfer for bit slots and the reset pulse, the interrupts stay
+// enabled.
+//
+uint8_t OneWireUsart::transfer(uint8_t *slots, uint16_t count){
+    start(slots, count);
 
-        delayMicroseconds(5);
-    }
+    return complete();
 }
 
 //
-// Read a bit. Port and bit is used to cut lookup time and provide
-// more certain timing.
+// Perform the onewire reset function.
+//
+// Returns 1 if a device asserted a presence pulse, 0 otherwise.
 //
-uint8_t OneWire::read_bit(void){
+uint8_t OneWireUsart::reset(void){
     uint8_t r;
 
-    noInterrupts();
-
-    DIRECT_MODE_OUTPUT();
-    DIRECT_WRITE_LOW();
-
-    delayMicroseconds(3);
-
-    DIRECT_MODE_INPUT();    // let pin float, pull up will raise
+    baud(9600);
 
-    delayMicroseconds(10);
+    _slots[0] = 0xF0;
 
-    r = DIRECT_READ();
+    // No echo change is no presence, an all low echo a shorted bus
+    r = transfer(_slots, 1) && _slots[0] != 0xF0 && _slots[0] != 0x00;
 
-    interrupts();
-    delayMicroseconds(53);
+    baud(115200);
 
     return r;
 }
 
-//
-// Write a byte. The writing code uses the active drivers to raise the
-// pin high, if you need power after the write (e.g. DS18S20 in
-// parasite power mode) then set 'power' to 1, otherwise the pin will
-// go tri-state at the end of the write to avoid heating in a short or
-// other mishap.
-//
-void OneWire::write(uint8_t v, uint8_t power /* = 0 */) {
-    uint8_t bitMask;
+void OneWireUsart::write_bit(uint8_t v){
+    _slots[0] = (v & 1) ? 0xFF : 0x00;
 
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-        OneWire::write_bit( (bitMask & v)?1:0);
-    }
+    transfer(_slots, 1);
+}
 
-    if ( !power) {
-        noInterrupts();
+uint8_t OneWireUsart::read_bit(void){
+    _slots[0] = 0xFF;
 
-        DIRECT_MODE_INPUT();
-        DIRECT_WRITE_LOW();
+    transfer(_slots, 1);
 
-        interrupts();
-    }
+    return _slots[0] == 0xFF;
 }
 
-void OneWire::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */) {
-    for (uint16_t i = 0 ; i < count ; i++)
-        write(buf[i]);
+//
+// Write a byte, LSB first. The bus idles high through the pull-up, there is
+// no strong pull-up so 'power' has no effect in USART mode.
+//
+void OneWireUsart::write(uint8_t v, uint8_t power /* = 0 */) {
+    write_bytes(&v, 1, power);
+}
 
-    if (!power) {
-        noInterrupts();
+uint8_t OneWireUsart::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */) {
+    while (count) {
+        uint16_t n = count > ONEWIRE_USART_SLOTS / 8 ? ONEWIRE_USART_SLOTS / 8 : count;
 
-        DIRECT_MODE_INPUT();
-        DIRECT_WRITE_LOW();
+        write_start(buf, n);
 
-        interrupts();
+        if (!finish())
+            return 0;
+
+        buf += n;
+        count -= n;
     }
+
+    return 1;
 }
 
 //
 // Read a byte
 //
-uint8_t OneWire::read() {
-    uint8_t bitMask;
-    uint8_t r = 0;
+uint8_t OneWireUsart::read() {
+    uint8_t r;
 
-    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
-        if ( OneWire::read_bit()) r |= bitMask;
-    }
+    read_bytes(&r, 1);
 
     return r;
 }
 
-void OneWire::read_bytes(uint8_t *buf, uint16_t count) {
-    for (uint16_t i = 0 ; i < count ; i++)
-        buf[i] = read();
+void OneWireUsart::read_bytes(uint8_t *buf, uint16_t count) {
+    while (count) {
+        uint16_t n = count > ONEWIRE_USART_SLOTS / 8 ? ONEWIRE_USART_SLOTS / 8 : count;
+
+        read_start(n);
+        finish(buf);
+
+        buf += n;
+        count -= n;
+    }
 }
 
 //
-// Do a ROM select
+// Split transfers, count is at most ONEWIRE_USART_SLOTS / 8. A scratchpad
+// read is 72 slots (6.3ms) on the bus, the caller gets on with other work
+// and polls busy() meanwhile.
 //
-void OneWire::select(const uint8_t rom[8]){
-    uint8_t i;
+void OneWireUsart::write_start(const uint8_t *buf, uint16_t count) {
+    for (uint16_t i = 0; i < count * 8; i++)
+        _slots[i] = (buf[i >> 3] & (1 << (i & 7))) ? 0xFF : 0x00;
 
-    write(0x55);           // Choose ROM
+    _reading = 0;
 
-    for (i = 0; i < 8; i++) write(rom[i]);
+    start(_slots, count * 8);
 }
 
-//
-// Do a ROM skip
-//
-void OneWire::skip(){
-    write(0xCC);           // Skip ROM
+void OneWireUsart::read_start(uint16_t count) {
+    memset(_slots, 0xFF, count * 8);
+
+    _reading = count;
+
+    start(_slots, count * 8);
 }
 
-void OneWire::depower(){
-    noInterrupts();
+uint8_t OneWireUsart::finish(uint8_t *buf /* = 0 */) {
+    uint8_t ok = complete();
 
-    DIRECT_MODE_INPUT();
+    if (!ok)
+        memset(_slots, 0xFF, _reading * 8);     // idle bus reads as all ones
 
-    interrupts();
-}
+    for (uint16_t i = 0; buf && i < _reading; i++) {
+        uint8_t r = 0;
 
-#if ONEWIRE_SEARCH
+        for (uint8_t b = 0; b < 8; b++)
+            if (_slots[i * 8 + b] == 0xFF) r |= 1 << b;
 
-//
-// You need to use this function to start a search again from the beginning.
-// You do not need to do it for the first search, though you could.
-//
-void OneWire::reset_search(){
-    // reset the search state
-    LastDiscrepancy = 0;
-    LastDeviceFlag = FALSE;
-    LastFamilyDiscrepancy = 0;
-
-    for(int i = 7; ; i--) {
-        ROM_NO[i] = 0;
-        if ( i == 0) break;
+        buf[i] = r;
     }
+
+    _reading = 0;
+
+    return ok;
+}
+
+void OneWireUsart::depower(){
 }
 
-// Setup the search to find the device type 'family_code' on the next call
-// to search(*newAddr) if it is present.
+#endif
+
+#if ONEWIRE_CRC
+// The 1-Wire CRC scheme is described in Maxim Application Note 27:
+// "Understanding and Using Cyclic Redundancy Checks with Maxim iButton Products"
 //
-void OneWire::target_search(uint8_t family_code){
-   // set the search state to find SearchFamily type devices
 
-   ROM_NO[0] = family_code;
+#if ONEWIRE_CRC8_TABLE == 1
+// Full lookup table, one load per byte (256 bytes of flash)
+static const uint8_t dscrc_table[256] = {
+    0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+    0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E, 0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
+    0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0, 0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
+    0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D, 0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
+    0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5, 0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
+    0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58, 0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
+    0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6, 0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
+    0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B, 0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
+    0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F, 0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
+    0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92, 0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
+    0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C, 0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
+    0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1, 0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
+    0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49, 0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
+    0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4, 0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
+    0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
+    0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35,
+};
+
+uint8_t OneWireBase::crc8(const uint8_t *addr, uint8_t len){
+    uint8_t crc = 0;
 
-   for (uint8_t i = 1; i < 8; i++)
-      ROM_NO[i] = 0;
+    while (len--) {
+        crc = dscrc_table[crc ^ *addr++];
+    }
 
-   LastDiscrepancy = 64;
-   LastFamilyDiscrepancy = 0;
-   LastDeviceFlag = FALSE;
+    return crc;
 }
 
-//
-// Perform a search. If this function returns a '1' then it has
-// enumerated the next device and you may retrieve the ROM from the
-// OneWire::address variable. If there are no devices, no further
-// devices, or something horrible happens in the middle of the
-// enumeration then a 0 is returned.  If a new device is found then
-// its address is copied to newAddr.  Use OneWire::reset_search() to
-// start over.
-//
-// --- Replaced by the one from the Dallas Semiconductor web site ---
-//--------------------------------------------------------------------------
-// Perform the 1-Wire Search Algorithm on the 1-Wire bus using the existing
-// search state.
-// Return TRUE  : device found, ROM number in ROM_NO buffer
-//        FALSE : device not found, end of search
-//
-uint8_t OneWire::search(uint8_t *newAddr){
-    uint8_t id_bit_number;
-    uint8_t last_zero, rom_byte_number, search_result;
-    uint8_t id_bit, cmp_id_bit;
-
-    unsigned char rom_byte_mask, search_direction;
-
-    // initialize for search
-    id_bit_number = 1;
-    last_zero = 0;
-    rom_byte_number = 0;
-    rom_byte_mask = 1;
-    search_result = 0;
-
-    // if the last call was not the last one
-    if (!LastDeviceFlag)
-    {
-        // 1-Wire reset
-        if (!reset()){
-            // reset the search
-            LastDiscrepancy = 0;
-            LastDeviceFlag = FALSE;
-            LastFamilyDiscrepancy = 0;
-
-            return FALSE;
-        }
+#elif ONEWIRE_CRC8_TABLE == 2
+// Two nibble tables, two loads per byte (32 bytes of flash). The CRC is
+// linear, so the table entry of a byte is the XOR of the entries of its
+// low and high nibble.
+static const uint8_t dscrc_lo[16] = {
+    0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41
+};
 
-        // issue the search command
-        write(0xF0);
-
-        // loop to do the search
-        do
-        {
-            // read a bit and its complement
-            id_bit = read_bit();
-            cmp_id_bit = read_bit();
-
-            // check for no devices on 1-wire
-            if ((id_bit == 1) && (cmp_id_bit == 1)){
-                break;
-            }
-            else
-            {
-                // all devices coupled have 0 or 1
-                if (id_bit != cmp_id_bit){
-                    search_direction = id_bit;  // bit write value for search
-                }
-                else{
-                    // if this discrepancy if before the Last Discrepancy
-                    // on a previous next then pick the same as last time
-                    if (id_bit_number < LastDiscrepancy)
-                        search_direction = ((ROM_NO[rom_byte_number] & rom_byte_mask) > 0);
-                    else
-                        // if equal to last pick 1, if not then pick 0
-                        search_direction = (id_bit_number == LastDiscrepancy);
-
-                    // if 0 was picked then record its position in LastZero
-                    if (search_direction == 0){
-                        last_zero = id_bit_number;
-
-                        // check for Last discrepancy in family
-                        if (last_zero < 9)
-                            LastFamilyDiscrepancy = last_zero;
-                    }
-                }
-
-                // set or clear the bit in the ROM byte rom_byte_number
-                // with mask rom_byte_mask
-                if (search_direction == 1)
-                  ROM_NO[rom_byte_number] |= rom_byte_mask;
-                else
-                  ROM_NO[rom_byte_number] &= ~rom_byte_mask;
-
-                // serial number search direction write bit
-                write_bit(search_direction);
-
-                // increment the byte counter id_bit_number
-                // and shift the mask rom_byte_mask
-                id_bit_number++;
-                rom_byte_mask <<= 1;
-
-                // if the mask is 0 then go to new SerialNum byte rom_byte_number and reset mask
-                if (rom_byte_mask == 0)
-                {
-                    rom_byte_number++;
-                    rom_byte_mask = 1;
-                }
-            }
-        }while(rom_byte_number < 8);  // loop until through all ROM bytes 0-7
-
-        // if the search was successful then
-        if (!(id_bit_number < 65))
-        {
-            // search successful so set LastDiscrepancy,LastDeviceFlag,search_result
-            LastDiscrepancy = last_zero;
-
-            // check for last device
-            if (LastDiscrepancy == 0)
-                LastDeviceFlag = TRUE;
-
-            search_result = TRUE;
-        }
-    }
+static const uint8_t dscrc_hi[16] = {
+    0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8, 0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
 
-    // if no device found then reset counters so next 'search' will be like a first
-    if (!search_result || !ROM_NO[0]){
-        LastDiscrepancy = 0;
-        LastDeviceFlag = FALSE;
-        LastFamilyDiscrepancy = 0;
-        search_result = FALSE;
-    }
+uint8_t OneWireBase::crc8(const uint8_t *addr, uint8_t len){
+    uint8_t crc = 0;
 
-    for (int i = 0; i < 8; i++) newAddr[i] = ROM_NO[i];
+    while (len--) {
+        uint8_t x = crc ^ *addr++;
+        crc = dscrc_lo[x & 0x0F] ^ dscrc_hi[x >> 4];
+    }
 
-    return search_result;
+    return crc;
 }
 
-#endif
-
-#if ONEWIRE_CRC
-// The 1-Wire CRC scheme is described in Maxim Application Note 27:
-// "Understanding and Using Cyclic Redundancy Checks with Maxim iButton Products"
+#else
 //
 // Compute a Dallas Semiconductor 8 bit CRC directly.
 // this is much slower, but much smaller, than the lookup table.
 //
-uint8_t OneWire::crc8( uint8_t *addr, uint8_t len){
+uint8_t OneWireBase::crc8(const uint8_t *addr, uint8_t len){
     uint8_t crc = 0;
 
     while (len--) {
@@ -437,15 +346,16 @@ uint8_t OneWire::crc8( uint8_t *addr, uint8_t len){
     return crc;
 }
 #endif
+#endif
 
 #if ONEWIRE_CRC16
-bool OneWire::check_crc16(const uint8_t* input, uint16_t len, const uint8_t* inverted_crc, uint16_t crc){
+bool OneWireBase::check_crc16(const uint8_t* input, uint16_t len, const uint8_t* inverted_crc, uint16_t crc){
     crc = ~crc16(input, len, crc);
 
     return (crc & 0xFF) == inverted_crc[0] && (crc >> 8) == inverted_crc[1];
 }
 
-uint16_t OneWire::crc16(const uint8_t* input, uint16_t len, uint16_t crc){
+uint16_t OneWireBase::crc16(const uint8_t* input, uint16_t len, uint16_t crc){
     static const uint8_t oddparity[16] =
         { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0 };
 
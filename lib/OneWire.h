@@ -7,6 +7,7 @@
 #define OneWire_h
 
 #include <inttypes.h>
+#include "application.h"
 // you can exclude onewire_search by defining that to 0
 #ifndef ONEWIRE_SEARCH
 #define ONEWIRE_SEARCH 1
@@ -17,6 +18,13 @@
 #define ONEWIRE_CRC 1
 #endif
 
+// Select the CRC8 implementation: 0 computes it bit by bit (smallest),
+// 1 uses a 256 byte lookup table (fastest), 2 uses two 16 entry nibble
+// tables (almost as fast, 32 bytes).
+#ifndef ONEWIRE_CRC8_TABLE
+#define ONEWIRE_CRC8_TABLE 1
+#endif
+
 
 // You can allow 16-bit CRC checks by defining this to 1
 // (Note that ONEWIRE_CRC must also be 1.)
@@ -24,51 +32,157 @@
 #define ONEWIRE_CRC16 1
 #endif
 
-class OneWire
+// You can move the bus onto the hardware USART by defining this to 1. The
+// data line then has to be wired to the TX pin (USART2, half-duplex, open
+// drain with the usual 4k7 pull-up) and Serial1 can't be used. Time slots
+// are generated by the USART (9600 baud for reset, 115200 baud per bit) and
+// whole bytes are moved by DMA, so no interrupt masking is needed.
+// Parasite power (strong pull-up) is not supported in this mode.
+#ifndef ONEWIRE_USART
+#define ONEWIRE_USART 0
+#endif
+
+// You can measure the bit-banged slot timing with the DWT cycle counter by
+// defining this to 1, see last_slot_cycles().
+#ifndef ONEWIRE_PROFILE
+#define ONEWIRE_PROFILE 0
+#endif
+
+// Bit slots per DMA transfer in USART mode (one frame per bit). 80 fits a
+// Match ROM, the ROM code and a function command into one transfer.
+#ifndef ONEWIRE_USART_SLOTS
+#define ONEWIRE_USART_SLOTS 80
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Pin policies for the bit-banged backend. Both provide the DIRECT_* register
+// accessors used by the time slots.
+
+// Pin chosen at run time. The CRL/CRH nibble, mask and BSRR/BRR/IDR pointers
+// are resolved once in the constructor, so switching the direction is a
+// single read-modify-write.
+class OneWireRuntimePin
 {
     private:
 
-        uint16_t _pin;
-        void DIRECT_WRITE_LOW(void);
-        void DIRECT_MODE_OUTPUT(void);
-        void DIRECT_WRITE_HIGH(void);
-        void DIRECT_MODE_INPUT(void);
-        uint8_t DIRECT_READ(void);
-#if ONEWIRE_SEARCH
-    // global search state
-    unsigned char ROM_NO[8];
-    uint8_t LastDiscrepancy;
-    uint8_t LastFamilyDiscrepancy;
-    uint8_t LastDeviceFlag;
+        volatile uint32_t *_cr;
+        uint32_t _crMask;
+        uint32_t _crOutput;
+        uint32_t _crInput;
+        volatile uint32_t *_bsrr;
+        volatile uint32_t *_brr;
+        volatile uint32_t *_idr;
+        uint16_t _bitmask;
+
+    public:
+        OneWireRuntimePin(uint16_t pin);
+
+        inline void DIRECT_WRITE_LOW(void) { *_brr = _bitmask; }
+        inline void DIRECT_WRITE_HIGH(void) { *_bsrr = _bitmask; }
+        inline void DIRECT_MODE_OUTPUT(void) { *_cr = (*_cr & ~_crMask) | _crOutput; }
+        inline void DIRECT_MODE_INPUT(void) { *_cr = (*_cr & ~_crMask) | _crInput; }
+        inline uint8_t DIRECT_READ(void) { return (*_idr & _bitmask) ? 1 : 0; }
+};
+
+// Pin fixed at compile time (GPIO port base address and bit number). The
+// object is empty and every accessor folds into a load/store on a constant
+// address.
+template <uint32_t PORT, uint8_t BIT>
+class OneWireStaticPin
+{
+    private:
+
+        static inline GPIO_TypeDef *port(void) { return (GPIO_TypeDef *) PORT; }
+        static inline volatile uint32_t &cr(void) { return (BIT < 8) ? port()->CRL : port()->CRH; }
+
+        static const uint32_t CR_SHIFT = (BIT & 7) * 4;
+        static const uint32_t CR_MASK = 0xFUL << CR_SHIFT;
+        static const uint32_t CR_OUTPUT = 0x3UL << CR_SHIFT;   // 50MHz push-pull
+        static const uint32_t CR_INPUT = 0x4UL << CR_SHIFT;    // floating input
+
+    public:
+        OneWireStaticPin() {
+            RCC_APB2PeriphClockCmd(PORT == GPIOA_BASE ? RCC_APB2Periph_GPIOA : RCC_APB2Periph_GPIOB, ENABLE);
+            DIRECT_MODE_INPUT();
+        }
+
+        static inline void DIRECT_WRITE_LOW(void) { port()->BRR = 1UL << BIT; }
+        static inline void DIRECT_WRITE_HIGH(void) { port()->BSRR = 1UL << BIT; }
+        static inline void DIRECT_MODE_OUTPUT(void) { cr() = (cr() & ~CR_MASK) | CR_OUTPUT; }
+        static inline void DIRECT_MODE_INPUT(void) { cr() = (cr() & ~CR_MASK) | CR_INPUT; }
+        static inline uint8_t DIRECT_READ(void) { return (port()->IDR >> BIT) & 1; }
+};
+
+// Spark Core pin names
+typedef OneWireStaticPin<GPIOB_BASE, 7>  OneWirePinD0;
+typedef OneWireStaticPin<GPIOB_BASE, 6>  OneWirePinD1;
+typedef OneWireStaticPin<GPIOB_BASE, 5>  OneWirePinD2;
+typedef OneWireStaticPin<GPIOB_BASE, 4>  OneWirePinD3;
+typedef OneWireStaticPin<GPIOB_BASE, 3>  OneWirePinD4;
+typedef OneWireStaticPin<GPIOA_BASE, 15> OneWirePinD5;
+typedef OneWireStaticPin<GPIOA_BASE, 14> OneWirePinD6;
+typedef OneWireStaticPin<GPIOA_BASE, 13> OneWirePinD7;
+typedef OneWireStaticPin<GPIOA_BASE, 0>  OneWirePinA0;
+typedef OneWireStaticPin<GPIOA_BASE, 1>  OneWirePinA1;
+typedef OneWireStaticPin<GPIOA_BASE, 4>  OneWirePinA2;
+typedef OneWireStaticPin<GPIOA_BASE, 5>  OneWirePinA3;
+typedef OneWireStaticPin<GPIOA_BASE, 6>  OneWirePinA4;
+typedef OneWireStaticPin<GPIOA_BASE, 7>  OneWirePinA5;
+typedef OneWireStaticPin<GPIOB_BASE, 0>  OneWirePinA6;
+typedef OneWireStaticPin<GPIOB_BASE, 1>  OneWirePinA7;
+
+////////////////////////////////////////////////////////////////////////////////
+// Slot layers: reset pulse, bit slots and byte transfers.
+
+// Bit-banged time slots on a GPIO pin
+template <class Pin>
+class OneWireBitBang
+{
+    private:
+
+        Pin _io;
+        uint16_t _reading;
+        uint8_t _written;
+#if ONEWIRE_PROFILE
+        uint32_t _slotCycles;
 #endif
+        void begin(void);
 
     public:
-        OneWire( uint16_t pin);
+        OneWireBitBang() { begin(); }
+        OneWireBitBang(uint16_t pin) : _io(pin) { begin(); }
 
         // Perform a 1-Wire reset cycle. Returns 1 if a device responds
         // with a presence pulse.  Returns 0 if there is no device or the
         // bus is shorted or otherwise held low for more than 250uS
         uint8_t reset(void);
 
-        // Issue a 1-Wire rom select command, you do the reset first.
-        void select(const uint8_t rom[8]);
-
-        // Issue a 1-Wire rom skip command, to address all on bus.
-        void skip(void);
-
         // Write a byte. If 'power' is one then the wire is held high at
         // the end for parasitically powered devices. You are responsible
         // for eventually depowering it by calling depower() or doing
         // another read or write.
         void write(uint8_t v, uint8_t power = 0);
 
-        void write_bytes(const uint8_t *buf, uint16_t count, bool power = 0);
+        // Write count bytes. Returns 0 if they didn't make it onto the bus,
+        // which only the USART backend can tell.
+        uint8_t write_bytes(const uint8_t *buf, uint16_t count, bool power = 0);
 
         // Read a byte.
         uint8_t read(void);
 
         void read_bytes(uint8_t *buf, uint16_t count);
 
+        // Split transfers for callers that poll instead of waiting.
+        // write_start() and read_start() put up to ONEWIRE_USART_SLOTS / 8
+        // bytes on the bus, busy() is 1 while they are still moving and
+        // finish() collects the result (the bytes read into buf), 0 if the
+        // transfer failed. Bit-banged slots can't run in the background,
+        // here the bytes move inside write_start() and finish().
+        void write_start(const uint8_t *buf, uint16_t count);
+        void read_start(uint16_t count);
+        uint8_t busy(void) { return 0; }
+        uint8_t finish(uint8_t *buf = 0);
+
         // Write a bit. The bus is always left powered at the end, see
         // note in write() about that.
         void write_bit(uint8_t v);
@@ -83,27 +197,59 @@ class OneWire
         // someone shorts your bus.
         void depower(void);
 
-#if ONEWIRE_SEARCH
-        // Clear the search state so that if will start from the beginning again.
-        void reset_search();
+#if ONEWIRE_PROFILE
+        // CPU cycles the last read_bit() took from pulling the line low to
+        // sampling it. Everything above 13us worth of cycles is overhead.
+        uint32_t last_slot_cycles(void) { return _slotCycles; }
+#endif
+};
 
-        // Setup the search to find the device type 'family_code' on the next call
-        // to search(*newAddr) if it is present.
-        void target_search(uint8_t family_code);
+#if ONEWIRE_USART
+// USART2 half-duplex time slots with DMA, see ONEWIRE_USART above. Same
+// interface as OneWireBitBang, the pin has to be TX.
+class OneWireUsart
+{
+    private:
 
-        // Look for the next device. Returns 1 if a new address has been
-        // returned. A zero might mean that the bus is shorted, there are
-        // no devices, or you have already retrieved all of them.  It
-        // might be a good idea to check the CRC to make sure you didn't
-        // get garbage.  The order is deterministic. You will always get
-        // the same devices in the same order.
-        uint8_t search(uint8_t *newAddr);
+        uint16_t _pin;
+        uint8_t _slots[ONEWIRE_USART_SLOTS];
+        uint8_t _active;
+        uint16_t _reading;
+        uint32_t _started;
+        uint32_t _timeout;
+        void baud(uint32_t rate);
+        void start(uint8_t *slots, uint16_t count);
+        uint8_t complete(void);
+        uint8_t transfer(uint8_t *slots, uint16_t count);
+
+    public:
+        OneWireUsart(uint16_t pin);
+
+        uint8_t reset(void);
+        void write(uint8_t v, uint8_t power = 0);
+        uint8_t write_bytes(const uint8_t *buf, uint16_t count, bool power = 0);
+        uint8_t read(void);
+        void read_bytes(uint8_t *buf, uint16_t count);
+        void write_start(const uint8_t *buf, uint16_t count);
+        void read_start(uint16_t count);
+        uint8_t busy(void);
+        uint8_t finish(uint8_t *buf = 0);
+        void write_bit(uint8_t v);
+        uint8_t read_bit(void);
+        void depower(void);
+};
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+// Protocol layer: ROM commands, search and CRC on top of a slot layer.
+
+class OneWireBase
+{
+    public:
 #if ONEWIRE_CRC
         // Compute a Dallas Semiconductor 8 bit CRC, these are used in the
         // ROM and scratchpad registers.
-        static uint8_t crc8(uint8_t *addr, uint8_t len);
+        static uint8_t crc8(const uint8_t *addr, uint8_t len);
 
 #if ONEWIRE_CRC16
         // Compute the 1-Wire CRC16 and compare it against the received CRC.
@@ -145,4 +291,482 @@ class OneWire
 #endif
 };
 
+template <class Slots>
+class OneWireBus : public Slots, public OneWireBase
+{
+    private:
+#if ONEWIRE_SEARCH
+    // global search state
+    unsigned char ROM_NO[8];
+    uint8_t LastDiscrepancy;
+    uint8_t LastFamilyDiscrepancy;
+    uint8_t LastDeviceFlag;
+#endif
+
+    public:
+        OneWireBus() {}
+        OneWireBus(uint16_t pin) : Slots(pin) {}
+
+        // Issue a 1-Wire rom select command, you do the reset first.
+        void select(const uint8_t rom[8]);
+
+        // Issue a 1-Wire rom skip command, to address all on bus.
+        void skip(void);
+
+#if ONEWIRE_SEARCH
+        // Clear the search state so that if will start from the beginning again.
+        void reset_search();
+
+        // Setup the search to find the device type 'family_code' on the next call
+        // to search(*newAddr) if it is present.
+        void target_search(uint8_t family_code);
+
+        // Look for the next device. Returns 1 if a new address has been
+        // returned. A zero might mean that the bus is shorted, there are
+        // no devices, or you have already retrieved all of them.  It
+        // might be a good idea to check the CRC to make sure you didn't
+        // get garbage.  The order is deterministic. You will always get
+        // the same devices in the same order.
+        uint8_t search(uint8_t *newAddr);
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Public bus types
+
+// Pin bound at compile time, e.g. StaticOneWire<OneWirePinD4>. No heap, and
+// the bit slots inline to straight register accesses.
+template <class Pin>
+class StaticOneWire : public OneWireBus< OneWireBitBang<Pin> >
+{
+};
+
+// Pin chosen at run time, the backend follows ONEWIRE_USART
+#if ONEWIRE_USART
+class OneWire : public OneWireBus<OneWireUsart>
+{
+    public:
+        OneWire(uint16_t pin) : OneWireBus<OneWireUsart>(pin) {}
+};
+#else
+class OneWire : public OneWireBus< OneWireBitBang<OneWireRuntimePin> >
+{
+    public:
+        OneWire(uint16_t pin) : OneWireBus< OneWireBitBang<OneWireRuntimePin> >(pin) {}
+};
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Template implementation
+
+template <class Pin>
+void OneWireBitBang<Pin>::begin(void){
+    _io.DIRECT_MODE_INPUT();
+    _reading = 0;
+    _written = 1;
+
+#if ONEWIRE_PROFILE
+    // Enable the DWT cycle counter
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA;
+    _slotCycles = 0;
+#endif
+}
+
+// Perform the onewire reset function.  We will wait up to 250uS for
+// the bus to come high, if it doesn't then it is broken or shorted
+// and we return a 0;
+//
+// Returns 1 if a device asserted a presence pulse, 0 otherwise.
+//
+template <class Pin>
+uint8_t OneWireBitBang<Pin>::reset(void){
+    uint8_t r;
+    uint8_t retries = 125;
+
+    noInterrupts();
+    _io.DIRECT_MODE_INPUT();
+    interrupts();
+    // wait until the wire is high... just in case
+    do {
+        if (--retries == 0) return 0;
+
+        delayMicroseconds(2);
+    } while ( !_io.DIRECT_READ());
+
+    noInterrupts();
+
+    _io.DIRECT_WRITE_LOW();
+    _io.DIRECT_MODE_OUTPUT();   // drive output low
+
+    interrupts();
+    delayMicroseconds(480);
+    noInterrupts();
+
+    _io.DIRECT_MODE_INPUT();    // allow it to float
+
+    delayMicroseconds(70);
+
+    r =! _io.DIRECT_READ();
+
+    interrupts();
+
+    delayMicroseconds(410);
+
+    return r;
+}
+
+template <class Pin>
+void OneWireBitBang<Pin>::write_bit(uint8_t v){
+    if (v & 1) {
+        noInterrupts();
+
+        _io.DIRECT_WRITE_LOW();
+        _io.DIRECT_MODE_OUTPUT();   // drive output low
+
+        delayMicroseconds(10);
+
+        _io.DIRECT_WRITE_HIGH();    // drive output high
+
+        interrupts();
+
+        delayMicroseconds(55);
+    } else {
+        noInterrupts();
+
+        _io.DIRECT_WRITE_LOW();
+        _io.DIRECT_MODE_OUTPUT();   // drive output low
+
+        delayMicroseconds(65);
+
+        _io.DIRECT_WRITE_HIGH();    // drive output high
+
+        interrupts();
+
+        delayMicroseconds(5);
+    }
+}
+
+//
+// Read a bit. Port and bit come from the pin policy, which keeps the
+// lookups out of the timing window.
+//
+template <class Pin>
+uint8_t OneWireBitBang<Pin>::read_bit(void){
+    uint8_t r;
+#if ONEWIRE_PROFILE
+    uint32_t start = DWT->CYCCNT;
+#endif
+
+    noInterrupts();
+
+    _io.DIRECT_MODE_OUTPUT();
+    _io.DIRECT_WRITE_LOW();
+
+    delayMicroseconds(3);
+
+    _io.DIRECT_MODE_INPUT();    // let pin float, pull up will raise
+
+    delayMicroseconds(10);
+
+    r = _io.DIRECT_READ();
+
+    interrupts();
+
+#if ONEWIRE_PROFILE
+    // Cycles from slot start to sample, nominally 13us worth of delays
+    _slotCycles = DWT->CYCCNT - start;
+#endif
+
+    delayMicroseconds(53);
+
+    return r;
+}
+
+//
+// Write a byte. The writing code uses the active drivers to raise the
+// pin high, if you need power after the write (e.g. DS18S20 in
+// parasite power mode) then set 'power' to 1, otherwise the pin will
+// go tri-state at the end of the write to avoid heating in a short or
+// other mishap.
+//
+template <class Pin>
+void OneWireBitBang<Pin>::write(uint8_t v, uint8_t power /* = 0 */) {
+    uint8_t bitMask;
+
+    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
+        write_bit( (bitMask & v)?1:0);
+    }
+
+    if ( !power) {
+        noInterrupts();
+
+        _io.DIRECT_MODE_INPUT();
+        _io.DIRECT_WRITE_LOW();
+
+        interrupts();
+    }
+}
+
+template <class Pin>
+uint8_t OneWireBitBang<Pin>::write_bytes(const uint8_t *buf, uint16_t count, bool power /* = 0 */) {
+    for (uint16_t i = 0 ; i < count ; i++)
+        write(buf[i]);
+
+    if (!power) {
+        noInterrupts();
+
+        _io.DIRECT_MODE_INPUT();
+        _io.DIRECT_WRITE_LOW();
+
+        interrupts();
+    }
+
+    return 1;
+}
+
+//
+// Read a byte
+//
+template <class Pin>
+uint8_t OneWireBitBang<Pin>::read() {
+    uint8_t bitMask;
+    uint8_t r = 0;
+
+    for (bitMask = 0x01; bitMask; bitMask <<= 1) {
+        if ( read_bit()) r |= bitMask;
+    }
+
+    return r;
+}
+
+template <class Pin>
+void OneWireBitBang<Pin>::read_bytes(uint8_t *buf, uint16_t count) {
+    for (uint16_t i = 0 ; i < count ; i++)
+        buf[i] = read();
+}
+
+template <class Pin>
+void OneWireBitBang<Pin>::write_start(const uint8_t *buf, uint16_t count) {
+    _reading = 0;
+    _written = write_bytes(buf, count);
+}
+
+template <class Pin>
+void OneWireBitBang<Pin>::read_start(uint16_t count) {
+    _reading = count;
+    _written = 1;
+}
+
+template <class Pin>
+uint8_t OneWireBitBang<Pin>::finish(uint8_t *buf /* = 0 */) {
+    if (_reading && buf)
+        read_bytes(buf, _reading);
+
+    _reading = 0;
+
+    return _written;
+}
+
+template <class Pin>
+void OneWireBitBang<Pin>::depower(){
+    noInterrupts();
+
+    _io.DIRECT_MODE_INPUT();
+
+    interrupts();
+}
+
+//
+// Do a ROM select
+//
+template <class Slots>
+void OneWireBus<Slots>::select(const uint8_t rom[8]){
+    uint8_t i;
+
+    this->write(0x55);           // Choose ROM
+
+    for (i = 0; i < 8; i++) this->write(rom[i]);
+}
+
+//
+// Do a ROM skip
+//
+template <class Slots>
+void OneWireBus<Slots>::skip(){
+    this->write(0xCC);           // Skip ROM
+}
+
+#if ONEWIRE_SEARCH
+
+//
+// You need to use this function to start a search again from the beginning.
+// You do not need to do it for the first search, though you could.
+//
+template <class Slots>
+void OneWireBus<Slots>::reset_search(){
+    // reset the search state
+    LastDiscrepancy = 0;
+    LastDeviceFlag = FALSE;
+    LastFamilyDiscrepancy = 0;
+
+    for(int i = 7; ; i--) {
+        ROM_NO[i] = 0;
+        if ( i == 0) break;
+    }
+}
+
+// Setup the search to find the device type 'family_code' on the next call
+// to search(*newAddr) if it is present.
+//
+template <class Slots>
+void OneWireBus<Slots>::target_search(uint8_t family_code){
+   // set the search state to find SearchFamily type devices
+
+   ROM_NO[0] = family_code;
+
+   for (uint8_t i = 1; i < 8; i++)
+      ROM_NO[i] = 0;
+
+   LastDiscrepancy = 64;
+   LastFamilyDiscrepancy = 0;
+   LastDeviceFlag = FALSE;
+}
+
+//
+// Perform a search. If this function returns a '1' then it has
+// enumerated the next device and you may retrieve the ROM from the
+// OneWireBus::address variable. If there are no devices, no further
+// devices, or something horrible happens in the middle of the
+// enumeration then a 0 is returned.  If a new device is found then
+// its address is copied to newAddr.  Use reset_search() to
+// start over.
+//
+// --- Replaced by the one from the Dallas Semiconductor web site ---
+//--------------------------------------------------------------------------
+// Perform the 1-Wire Search Algorithm on the 1-Wire bus using the existing
+// search state.
+// Return TRUE  : device found, ROM number in ROM_NO buffer
+//        FALSE : device not found, end of search
+//
+template <class Slots>
+uint8_t OneWireBus<Slots>::search(uint8_t *newAddr){
+    uint8_t id_bit_number;
+    uint8_t last_zero, rom_byte_number, search_result;
+    uint8_t id_bit, cmp_id_bit;
+
+    unsigned char rom_byte_mask, search_direction;
+
+    // initialize for search
+    id_bit_number = 1;
+    last_zero = 0;
+    rom_byte_number = 0;
+    rom_byte_mask = 1;
+    search_result = 0;
+
+    // if the last call was not the last one
+    if (!LastDeviceFlag)
+    {
+        // 1-Wire reset
+        if (!this->reset()){
+            // reset the search
+            LastDiscrepancy = 0;
+            LastDeviceFlag = FALSE;
+            LastFamilyDiscrepancy = 0;
+
+            return FALSE;
+        }
+
+        // issue the search command
+        this->write(0xF0);
+
+        // loop to do the search
+        do
+        {
+            // read a bit and its complement
+            id_bit = this->read_bit();
+            cmp_id_bit = this->read_bit();
+
+            // check for no devices on 1-wire
+            if ((id_bit == 1) && (cmp_id_bit == 1)){
+                break;
+            }
+            else
+            {
+                // all devices coupled have 0 or 1
+                if (id_bit != cmp_id_bit){
+                    search_direction = id_bit;  // bit write value for search
+                }
+                else{
+                    // if this discrepancy if before the Last Discrepancy
+                    // on a previous next then pick the same as last time
+                    if (id_bit_number < LastDiscrepancy)
+                        search_direction = ((ROM_NO[rom_byte_number] & rom_byte_mask) > 0);
+                    else
+                        // if equal to last pick 1, if not then pick 0
+                        search_direction = (id_bit_number == LastDiscrepancy);
+
+                    // if 0 was picked then record its position in LastZero
+                    if (search_direction == 0){
+                        last_zero = id_bit_number;
+
+                        // check for Last discrepancy in family
+                        if (last_zero < 9)
+                            LastFamilyDiscrepancy = last_zero;
+                    }
+                }
+
+                // set or clear the bit in the ROM byte rom_byte_number
+                // with mask rom_byte_mask
+                if (search_direction == 1)
+                  ROM_NO[rom_byte_number] |= rom_byte_mask;
+                else
+                  ROM_NO[rom_byte_number] &= ~rom_byte_mask;
+
+                // serial number search direction write bit
+                this->write_bit(search_direction);
+
+                // increment the byte counter id_bit_number
+                // and shift the mask rom_byte_mask
+                id_bit_number++;
+                rom_byte_mask <<= 1;
+
+                // if the mask is 0 then go to new SerialNum byte rom_byte_number and reset mask
+                if (rom_byte_mask == 0)
+                {
+                    rom_byte_number++;
+                    rom_byte_mask = 1;
+                }
+            }
+        }while(rom_byte_number < 8);  // loop until through all ROM bytes 0-7
+
+        // if the search was successful then
+        if (!(id_bit_number < 65))
+        {
+            // search successful so set LastDiscrepancy,LastDeviceFlag,search_result
+            LastDiscrepancy = last_zero;
+
+            // check for last device
+            if (LastDiscrepancy == 0)
+                LastDeviceFlag = TRUE;
+
+            search_result = TRUE;
+        }
+    }
+
+    // if no device found then reset counters so next 'search' will be like a first
+    if (!search_result || !ROM_NO[0]){
+        LastDiscrepancy = 0;
+        LastDeviceFlag = FALSE;
+        LastFamilyDiscrepancy = 0;
+        search_result = FALSE;
+    }
+
+    for (int i = 0; i < 8; i++) newAddr[i] = ROM_NO[i];
+
+    return search_result;
+}
+
+#endif
+
 #endif
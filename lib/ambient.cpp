@@ -0,0 +1,149 @@
+/*
+Closed-loop ambient light control. A PI controller holds the light at the
+sensor (ambient plus the lamp's own, see luxLamp()) at a lux setpoint by
+moving one channel.
+Readings go through an exponential filter (1/4 per period, lux in Q4). Each
+period computes u = Kp * e + I in Q8 levels. Then u is limited to the rate
+and to 0..65535, and the integrator is set back to what was actually applied
+minus the P part, so saturation and the rate limit can't wind it up.
+The step is handed to the fade engine over one period, so the output moves
+in 1 ms increments instead of 100 ms jumps.
+*/
+
+#include "ambient.h"
+
+static uint8_t          channel                                                 ;
+static boolean          active          =               false                   ;
+static boolean          primed                                                  ;
+static uint32_t         last                                                    ;
+static int32_t          filtered                                                ;
+static int64_t          integral                                                ;
+static int32_t          output                                                  ;
+
+static uint16_t         setpoint        =               AMBIENT_SETPOINT        ;
+static uint16_t         kp              =               AMBIENT_KP              ;
+static uint16_t         ki              =               AMBIENT_KI              ;
+static uint16_t         rate            =               AMBIENT_RATE            ;
+
+void                    ambientInit     (uint8_t ch)
+{
+    channel = ch;
+}
+
+void                    ambientStart    (void)
+{
+    if (active)
+    {
+        return;
+    }
+
+    // The first tick seeds the filter and the integrator from where we are
+    primed = false;
+    active = true;
+}
+
+void                    ambientStop     (void)
+{
+    active = false;
+}
+
+boolean                 ambientActive   (void)
+{
+    return active;
+}
+
+void                    ambientTick     (uint16_t lux, uint16_t lamp)
+{
+    uint32_t now = millis();
+
+    if (!active)
+    {
+        return;
+    }
+
+    if (!primed)
+    {
+        filtered = (int32_t) lux << 4;
+        output   = fadeValue(channel);
+        integral = ((int64_t) output << 8) - (int64_t) kp * (setpoint - lux);
+        last     = now;
+        primed   = true;
+        return;
+    }
+
+    uint32_t dt = now - last;
+
+    if (dt < AMBIENT_PERIOD_MS)
+    {
+        return;
+    }
+
+    // A stalled loop shouldn't turn into one huge step
+    last = now;
+    dt   = (dt > 1000) ? 1000 : dt;
+
+    filtered += (((int32_t) lux << 4) - filtered) >> 2;
+
+    // Kp * e alone spans +-2^32 (full gain, full scale error): 64 bit
+    int32_t e = setpoint - (filtered >> 4);
+    int64_t p = (int64_t) kp * e;
+    int64_t u;
+
+    // Own light not seen: integrating would only run W into the rail
+    if (lamp > 0 || output == 0)
+    {
+        integral += ((int64_t) ki * e * dt) / 1000;
+    }
+
+    u         = (p + integral) >> 8;
+
+    int32_t step = (uint32_t) rate * dt / 1000;
+    int64_t v    = u;
+
+    v = (v > output + step) ? output + step : v;
+    v = (v < output - step) ? output - step : v;
+    v = (v > 65535) ? 65535 : (v < 0 ? 0 : v);
+
+    // Back-calculation: when limited, the integrator follows what's applied
+    if (v != u)
+    {
+        integral = ((int64_t) v << 8) - p;
+        u        = v;
+    }
+
+    if (u != output)
+    {
+        output = u;
+        fadeStart(channel, u, AMBIENT_PERIOD_MS);
+    }
+}
+
+void                    ambientSetpoint (uint16_t lux)
+{
+    setpoint = lux;
+}
+
+void                    ambientGains    (uint16_t p, uint16_t i)
+{
+    kp = p;
+    ki = i;
+    primed = false;
+}
+
+void                    ambientRate     (uint16_t r)
+{
+    rate = r;
+}
+
+uint16_t                ambientEstimate (uint16_t lux)
+{
+    // Proportional part on top of the current value, no rate limit
+    int64_t v = fadeValue(channel) + (((int64_t) kp * (setpoint - lux)) >> 8);
+
+    return (v > 65535) ? 65535 : (v < 0 ? 0 : v);
+}
+
+uint16_t                ambientFiltered (void)
+{
+    return filtered >> 4;
+}
@@ -0,0 +1,112 @@
+#ifndef AMBIENT_H
+#define AMBIENT_H
+
+#include "application.h"
+#include "fade.h"
+
+// Control period (ms), each output step is faded over one period //////////////
+
+const uint16_t AMBIENT_PERIOD_MS =      100                                     ;
+
+// Defaults: setpoint in lux, gains in Q8 (levels per lux, levels per lux and //
+// second), rate limit in levels per second (8192: full range in 8 s) //////////
+
+const uint16_t AMBIENT_SETPOINT =       250                                     ;
+const uint16_t AMBIENT_KP =             16 * 256                                ;
+const uint16_t AMBIENT_KI =             32 * 256                                ;
+const uint16_t AMBIENT_RATE =           8192                                    ;
+
+/*******************************************************************************
+ * Function Name  : ambientInit
+ * Description    : Binds the controller to the fade channel it drives
+ * Input          : Fade channel (the W channel)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    ambientInit     (uint8_t ch)                            ;
+
+/*******************************************************************************
+ * Function Name  : ambientStart
+ * Description    : Starts regulating the channel toward the lux setpoint,
+ *                  bumpless from its current value
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    ambientStart    (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : ambientStop
+ * Description    : Stops regulating, the channel keeps its current value
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    ambientStop     (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : ambientActive
+ * Description    : Tells whether the controller is running
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while regulating
+ *******************************************************************************/
+
+boolean                 ambientActive   (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : ambientTick
+ * Description    : Filters the reading and, once per AMBIENT_PERIOD_MS, runs
+ *                  one PI step: the output is rate limited and clamped, and
+ *                  the integrator tracks what was actually applied so it
+ *                  can't wind up. While the lamp's share reads 0 with the
+ *                  output on (no self-light table, W not seen by the
+ *                  sensor) the integrator holds: more output would change
+ *                  nothing it can see. Never blocks. Call on every pass of
+ *                  loop().
+ * Input          : Light at the sensor in lux, the lamp's own included,
+ *                  and the lamp's share of it (luxLamp())
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    ambientTick     (uint16_t lux, uint16_t lamp)           ;
+
+/*******************************************************************************
+ * Function Name  : ambientSetpoint / ambientGains / ambientRate
+ * Description    : Tuning, takes effect with the next period
+ * Input          : Setpoint in lux / Kp, Ki (Q8) / Rate limit (levels per s)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    ambientSetpoint (uint16_t lux)                          ;
+void                    ambientGains    (uint16_t kp, uint16_t ki)              ;
+void                    ambientRate     (uint16_t rate)                         ;
+
+/*******************************************************************************
+ * Function Name  : ambientEstimate
+ * Description    : Output the controller would head for if started now at
+ *                  this reading (current value plus the P term, no rate
+ *                  limit), for arming the first move ahead of time
+ * Input          : Light at the sensor in lux, the lamp's own included
+ * Output         : None.
+ * Return         : Channel value (0-65535)
+ *******************************************************************************/
+
+uint16_t                ambientEstimate (uint16_t lux)                          ;
+
+/*******************************************************************************
+ * Function Name  : ambientFiltered
+ * Description    : Filtered ambient light the controller works with
+ * Input          : None.
+ * Output         : None.
+ * Return         : Lux
+ *******************************************************************************/
+
+uint16_t                ambientFiltered (void)                                  ;
+
+#endif
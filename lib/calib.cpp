@@ -0,0 +1,198 @@
+/*
+Per-fixture colour calibration. The requested levels are CIE1931 lightness,
+so they go to linear light first (colorLinear, Q15), through the 4x4
+correction matrix and the per channel maxima, and back to levels. The maxima
+are folded into an effective matrix whenever the calibration changes, which
+leaves 16 multiply-accumulates on the hot path; with identity calibration
+the whole stage is skipped.
+*/
+
+#include "calib.h"
+#include "color.h"
+
+static int16_t          matrix          [CALIB_CHANNELS][CALIB_CHANNELS]        ;
+static uint16_t         maxima          [CALIB_CHANNELS]                        ;
+
+// matrix scaled by maxima, what calibApply() uses
+static int32_t          effective       [CALIB_CHANNELS][CALIB_CHANNELS]        ;
+static boolean          identity        =               true                    ;
+
+static void             calibUpdate     (void)
+{
+    identity = true;
+
+    for (uint8_t i = 0; i < CALIB_CHANNELS; i++)
+    {
+        for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+        {
+            effective[i][j] = ((int32_t) matrix[i][j] * (maxima[i] + 1)) >> 16;
+
+            if (effective[i][j] != ((i == j) ? CALIB_ONE : 0))
+            {
+                identity = false;
+            }
+        }
+    }
+}
+
+boolean                 calibInit       (void)
+{
+    if (calibLoad())
+    {
+        return true;
+    }
+
+    calibReset();
+    return false;
+}
+
+void                    calibApply      (const uint16_t *in, uint16_t *out)
+{
+    int32_t lin[CALIB_CHANNELS];
+
+    if (identity)
+    {
+        for (uint8_t i = 0; i < CALIB_CHANNELS; i++)
+        {
+            out[i] = in[i];
+        }
+
+        return;
+    }
+
+    for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+    {
+        lin[j] = colorLinear(in[j]);
+    }
+
+    // |coefficient| <= 2.0 and input <= 1.0 (Q15): 4 terms fit 32 bit
+    for (uint8_t i = 0; i < CALIB_CHANNELS; i++)
+    {
+        int32_t acc = 0;
+
+        for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+        {
+            acc += effective[i][j] * lin[j];
+        }
+
+        out[i] = colorLevel(acc >> 12);
+    }
+}
+
+boolean                 calibSetRow     (uint8_t row, const int16_t *coef)
+{
+    if (row >= CALIB_CHANNELS)
+    {
+        return false;
+    }
+
+    for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+    {
+        if (coef[j] > CALIB_LIMIT || coef[j] < -CALIB_LIMIT)
+        {
+            return false;
+        }
+    }
+
+    for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+    {
+        matrix[row][j] = coef[j];
+    }
+
+    calibUpdate();
+    return true;
+}
+
+void                    calibSetMax     (const uint16_t *max)
+{
+    for (uint8_t i = 0; i < CALIB_CHANNELS; i++)
+    {
+        maxima[i] = max[i];
+    }
+
+    calibUpdate();
+}
+
+void                    calibReset      (void)
+{
+    for (uint8_t i = 0; i < CALIB_CHANNELS; i++)
+    {
+        for (uint8_t j = 0; j < CALIB_CHANNELS; j++)
+        {
+            matrix[i][j] = (i == j) ? CALIB_ONE : 0;
+        }
+
+        maxima[i] = 65535;
+    }
+
+    calibUpdate();
+}
+
+// Matrix then maxima, 16 bit little endian, as stored after the magic byte
+static uint16_t         calibWord       (uint8_t k)
+{
+    const uint8_t n = CALIB_CHANNELS * CALIB_CHANNELS;
+
+    return (k < n) ? (uint16_t) matrix[k / CALIB_CHANNELS][k % CALIB_CHANNELS]
+                   : maxima[k - n];
+}
+
+boolean                 calibLoad       (void)
+{
+    const uint8_t n = CALIB_CHANNELS * CALIB_CHANNELS + CALIB_CHANNELS;
+    uint16_t      word[n];
+    uint8_t       sum = CALIB_MAGIC;
+
+    if (EEPROM.read(CALIB_EEPROM_ADDR) != CALIB_MAGIC)
+    {
+        return false;
+    }
+
+    for (uint8_t k = 0; k < n; k++)
+    {
+        uint8_t lo = EEPROM.read(CALIB_EEPROM_ADDR + 1 + 2 * k);
+        uint8_t hi = EEPROM.read(CALIB_EEPROM_ADDR + 2 + 2 * k);
+
+        word[k] = lo | (hi << 8);
+        sum    += lo + hi;
+    }
+
+    if (EEPROM.read(CALIB_EEPROM_ADDR + 1 + 2 * n) != sum)
+    {
+        return false;
+    }
+
+    for (uint8_t k = 0; k < n; k++)
+    {
+        if (k < CALIB_CHANNELS * CALIB_CHANNELS)
+        {
+            matrix[k / CALIB_CHANNELS][k % CALIB_CHANNELS] = (int16_t) word[k];
+        }
+        else
+        {
+            maxima[k - CALIB_CHANNELS * CALIB_CHANNELS] = word[k];
+        }
+    }
+
+    calibUpdate();
+    return true;
+}
+
+void                    calibSave       (void)
+{
+    const uint8_t n = CALIB_CHANNELS * CALIB_CHANNELS + CALIB_CHANNELS;
+    uint8_t       sum = CALIB_MAGIC;
+
+    EEPROM.write(CALIB_EEPROM_ADDR, CALIB_MAGIC);
+
+    for (uint8_t k = 0; k < n; k++)
+    {
+        uint16_t w = calibWord(k);
+
+        EEPROM.write(CALIB_EEPROM_ADDR + 1 + 2 * k, w & 0xFF);
+        EEPROM.write(CALIB_EEPROM_ADDR + 2 + 2 * k, w >> 8);
+        sum += (w & 0xFF) + (w >> 8);
+    }
+
+    EEPROM.write(CALIB_EEPROM_ADDR + 1 + 2 * n, sum);
+}
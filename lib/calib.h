@@ -0,0 +1,88 @@
+#ifndef CALIB_H
+#define CALIB_H
+
+#include "application.h"
+
+// Channels corrected together (R, G, B, W, fade channel order) ////////////////
+
+const uint8_t CALIB_CHANNELS =          4                                       ;
+
+// Matrix coefficients are Q12, limited to +-2.0 so the sums fit 32 bit ////////
+
+const int16_t CALIB_ONE =               4096                                    ;
+const int16_t CALIB_LIMIT =             8192                                    ;
+
+// EEPROM (emulated) layout: magic, 16 coefficients, 4 max, checksum ///////////
+
+const uint8_t CALIB_EEPROM_ADDR =       0                                       ;
+const uint8_t CALIB_MAGIC =             0xC4                                    ;
+
+/*******************************************************************************
+ * Function Name  : calibInit
+ * Description    : Loads the fixture calibration from EEPROM, identity if
+ *                  there is none (or it doesn't check out)
+ * Input          : None.
+ * Output         : None.
+ * Return         : true if a stored calibration was loaded
+ *******************************************************************************/
+
+boolean                 calibInit       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : calibApply
+ * Description    : Requested levels to output levels: linear light, 4x4
+ *                  matrix (out = M * in), per channel max scaling, back to
+ *                  levels. Integer only; skipped when the calibration is
+ *                  identity. Called for every frame that reaches the PWM.
+ * Input          : Requested levels (CALIB_CHANNELS, 0-65535)
+ * Output         : Output levels (may be the same array)
+ * Return         : None
+ *******************************************************************************/
+
+void                    calibApply      (const uint16_t *in, uint16_t *out)     ;
+
+/*******************************************************************************
+ * Function Name  : calibSetRow
+ * Description    : Sets one row of the matrix (how much of each requested
+ *                  channel goes into output channel row). Takes effect
+ *                  immediately, calibSave() makes it stick
+ * Input          : Row (output channel), CALIB_CHANNELS coefficients (Q12)
+ * Output         : None.
+ * Return         : false on a bad row or a coefficient beyond CALIB_LIMIT
+ *******************************************************************************/
+
+boolean                 calibSetRow     (uint8_t row, const int16_t *coef)      ;
+
+/*******************************************************************************
+ * Function Name  : calibSetMax
+ * Description    : Sets the per channel maximum (share of full current the
+ *                  channel may draw, 65535 = full). Takes effect immediately
+ * Input          : CALIB_CHANNELS maxima
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    calibSetMax     (const uint16_t *max)                   ;
+
+/*******************************************************************************
+ * Function Name  : calibReset
+ * Description    : Identity matrix, full maxima (not saved)
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    calibReset      (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : calibLoad / calibSave
+ * Description    : Reads / writes the calibration from / to EEPROM
+ * Input          : None.
+ * Output         : None.
+ * Return         : calibLoad: false (and nothing changed) if no valid data
+ *******************************************************************************/
+
+boolean                 calibLoad       (void)                                  ;
+void                    calibSave       (void)                                  ;
+
+#endif
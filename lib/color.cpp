@@ -0,0 +1,478 @@
+/*
+Colour space fades in fixed point. Both endpoints go to linear light (Q15,
+W folded in as white, so up to 2.0), then to HSV or OKLab in polar form
+(lightness, chroma, hue). Each step interpolates there, hue along the short
+arc, and comes back: cube roots from a small table, sine/cosine and atan2 by
+16 step CORDIC, matrices in Q14 with 64 bit accumulators. Hue is a uint32
+turn (2^32 = 360 deg) so it wraps on its own.
+*/
+
+#include "color.h"
+#include "gamma.h"
+
+// cbrt(i / 128) in Q15, used on [1/8, 1] after scaling by powers of 8 ////////
+
+namespace
+{
+    constexpr double newton     (double x, double g, uint8_t n)
+    {
+        return n == 0 ? g : newton(x, (2.0 * g + x / (g * g)) / 3.0, n - 1);
+    }
+
+    constexpr uint16_t cbrtEntry(uint16_t i)
+    {
+        return i == 0 ? 0 : (uint16_t)(newton(i / 128.0, 1.0, 24) * 32768.0 + 0.5);
+    }
+
+    struct CbrtLUT
+    {
+        uint16_t v[129];
+    };
+
+    template <uint16_t... I>
+    constexpr CbrtLUT makeCbrtLUT(gamma_lut::seq<I...>)
+    {
+        return CbrtLUT {{ cbrtEntry(I)... }};
+    }
+}
+
+static constexpr CbrtLUT CBRT = makeCbrtLUT(gamma_lut::make_seq<129>::type());
+
+// atan(2^-i) in 2^32 per turn, CORDIC gain 1/K in Q15
+static const uint32_t   ATAN[16]        = { 536870912, 316933406, 167458907,
+                                            85004756,  42667331,  21354465,
+                                            10679838,  5340245,   2670163,
+                                            1335087,   667544,    333772,
+                                            166886,    83443,     41722,
+                                            20861 }                             ;
+static const int32_t    CORDIC_INV_K    =               19898                   ;
+
+// OKLab matrices (Q14), rows rounded so white maps to white
+static const int32_t    M1[3][3]        = { {  6754,   8787,   843 },
+                                            {  3472,  11152,  1760 },
+                                            {  1447,   4616, 10321 } }          ;
+static const int32_t    M2[3][3]        = { {  3448,  13003,   -67 },
+                                            { 32408, -39790,  7382 },
+                                            {   424,  12825, -13249 } }         ;
+static const int32_t    M2I[3][3]       = { { 16384,   6494,  3536 },
+                                            { 16384,  -1730, -1046 },
+                                            { 16384,  -1466, -21160 } }         ;
+static const int32_t    M1I[3][3]       = { { 66793, -54194,  3785 },
+                                            { -20782, 42758, -5592 },
+                                            {   -69, -11525, 27978 } }          ;
+
+typedef struct
+{
+    int32_t     l                                                               ;
+    int32_t     c                                                               ;
+    uint32_t    h                                                               ;
+} lch_t                                                                         ;
+
+static lch_t            from                                                    ;
+static lch_t            to                                                      ;
+static int32_t          dh                                                      ;
+static uint8_t          space                                                   ;
+static uint32_t         start                                                   ;
+static uint32_t         length                                                  ;
+static uint64_t         rate                                                    ;
+static boolean          active          =               false                   ;
+
+static uint32_t         cyclesAvg16     =               0                       ;
+static uint32_t         cyclesMax       =               0                       ;
+
+int32_t                 colorLinear     (uint16_t level)
+{
+    // Inverse of L* = 116 * cbrt(Y) - 16, linear below L* 8
+    if (level <= 5243)
+    {
+        return ((uint32_t) level * 3628) >> 16;
+    }
+
+    int32_t f = (((uint32_t) level * 28248 + 32768) >> 16) + 4520;
+
+    return (((f * f) >> 15) * f) >> 15;
+}
+
+// Q15 cube root, x up to 4.0
+static int32_t          cbrtQ15         (int32_t x)
+{
+    int8_t k = 0;
+
+    if (x <= 0)
+    {
+        return 0;
+    }
+
+    // cbrt(8x) = 2 cbrt(x): bring x into [1/8, 1)
+    while (x >= 32768)
+    {
+        x >>= 3;
+        k++;
+    }
+
+    while (x < 4096)
+    {
+        x <<= 3;
+        k--;
+    }
+
+    uint8_t idx = x >> 8;
+    int32_t r   = CBRT.v[idx] + (((CBRT.v[idx + 1] - CBRT.v[idx]) * (x & 0xFF)) >> 8);
+
+    return (k >= 0) ? r << k : r >> -k;
+}
+
+uint16_t                colorLevel      (int32_t linear)
+{
+    int32_t level;
+
+    if (linear <= 0)
+    {
+        return 0;
+    }
+
+    if (linear <= 290)
+    {
+        level = (linear * 1183955LL) >> 16;
+    }
+    else
+    {
+        level = ((int64_t)(cbrtQ15(linear) - 4520) * 152043) >> 16;
+    }
+
+    return (level > 65535) ? 65535 : level;
+}
+
+static void             mul3            (const int32_t m[3][3], const int32_t *in,
+                                         int32_t *out)
+{
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        out[i] = ((int64_t) m[i][0] * in[0] + (int64_t) m[i][1] * in[1] +
+                  (int64_t) m[i][2] * in[2]) >> 14;
+    }
+}
+
+// CORDIC vectoring: (x, y) -> magnitude, angle
+static void             polar           (int32_t x, int32_t y, int32_t *mag,
+                                         uint32_t *angle)
+{
+    uint32_t a = 0;
+
+    if (x < 0)
+    {
+        x = -x;
+        y = -y;
+        a = 0x80000000;
+    }
+
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        int32_t nx;
+
+        if (y > 0)
+        {
+            nx = x + (y >> i);
+            y -= x >> i;
+            a += ATAN[i];
+        }
+        else
+        {
+            nx = x - (y >> i);
+            y += x >> i;
+            a -= ATAN[i];
+        }
+
+        x = nx;
+    }
+
+    *mag   = ((int64_t) x * CORDIC_INV_K) >> 15;
+    *angle = a;
+}
+
+// CORDIC rotation: magnitude, angle -> (x, y)
+static void             cartesian       (int32_t mag, uint32_t angle, int32_t *x,
+                                         int32_t *y)
+{
+    int32_t cx = ((int64_t) mag * CORDIC_INV_K) >> 15;
+    int32_t cy = 0;
+    int32_t z  = angle;
+
+    // Converges within +-90 deg, start from the opposite side beyond that
+    if (z > 0x40000000 || z < -0x40000000)
+    {
+        cx = -cx;
+        z  = (int32_t)((uint32_t) z + 0x80000000);
+    }
+
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        int32_t nx;
+
+        if (z >= 0)
+        {
+            nx  = cx - (cy >> i);
+            cy += cx >> i;
+            z  -= ATAN[i];
+        }
+        else
+        {
+            nx  = cx + (cy >> i);
+            cy -= cx >> i;
+            z  += ATAN[i];
+        }
+
+        cx = nx;
+    }
+
+    *x = cx;
+    *y = cy;
+}
+
+// Linear RGB (Q15) -> lightness, chroma, hue
+static void             toLch           (const int32_t *rgb, lch_t *out)
+{
+    if (space == COLOR_HSV)
+    {
+        int32_t max = rgb[0], min = rgb[0];
+        uint8_t top = 0;
+
+        for (uint8_t i = 1; i < 3; i++)
+        {
+            if (rgb[i] > max)
+            {
+                max = rgb[i];
+                top = i;
+            }
+
+            min = (rgb[i] < min) ? rgb[i] : min;
+        }
+
+        int32_t d = max - min;
+
+        out->l = max;
+        out->c = (max > 0) ? ((int64_t) d << 15) / max : 0;
+        out->h = 0;
+
+        if (d > 0)
+        {
+            // Sector 0, 2, 4 for R, G, B on top, +-1 towards the next one
+            int32_t num = rgb[(top + 1) % 3] - rgb[(top + 2) % 3];
+            int64_t h6  = ((int64_t) top * 2 << 16) + ((int64_t) num << 16) / d;
+
+            out->h = (uint32_t)((h6 * 715827883LL) >> 16);
+        }
+
+        return;
+    }
+
+    int32_t lms[3], lab[3];
+
+    mul3(M1, rgb, lms);
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        lms[i] = cbrtQ15(lms[i]);
+    }
+
+    mul3(M2, lms, lab);
+
+    out->l = lab[0];
+    polar(lab[1], lab[2], &out->c, &out->h);
+}
+
+// Lightness, chroma, hue -> linear RGB (Q15)
+static void             toRgb           (const lch_t *in, int32_t *rgb)
+{
+    if (space == COLOR_HSV)
+    {
+        uint32_t h6 = ((uint64_t) in->h * 6) >> 16;
+        uint32_t f  = h6 & 0xFFFF;
+        int32_t  v  = in->l;
+        int32_t  p  = ((int64_t) v * (32768 - in->c)) >> 15;
+        int32_t  q  = ((int64_t) v * (32768 - ((in->c * (int64_t) f) >> 16))) >> 15;
+        int32_t  t  = ((int64_t) v * (32768 - ((in->c * (int64_t)(65536 - f)) >> 16))) >> 15;
+
+        switch (h6 >> 16)
+        {
+            case 0:  rgb[0] = v; rgb[1] = t; rgb[2] = p; break;
+            case 1:  rgb[0] = q; rgb[1] = v; rgb[2] = p; break;
+            case 2:  rgb[0] = p; rgb[1] = v; rgb[2] = t; break;
+            case 3:  rgb[0] = p; rgb[1] = q; rgb[2] = v; break;
+            case 4:  rgb[0] = t; rgb[1] = p; rgb[2] = v; break;
+            default: rgb[0] = v; rgb[1] = p; rgb[2] = q; break;
+        }
+
+        return;
+    }
+
+    int32_t lab[3], lms[3];
+
+    lab[0] = in->l;
+    cartesian(in->c, in->h, &lab[1], &lab[2]);
+
+    mul3(M2I, lab, lms);
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        int64_t x = (lms[i] < 0) ? 0 : lms[i];
+
+        lms[i] = (((x * x) >> 15) * x) >> 15;
+    }
+
+    mul3(M1I, lms, rgb);
+}
+
+// White extraction: the common part of R, G, B goes to W
+static void             emit            (int32_t *rgb)
+{
+    uint16_t out[FADE_CHANNELS];
+    int32_t  w = 32768;
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        rgb[i] = (rgb[i] < 0) ? 0 : rgb[i];
+        w = (rgb[i] < w) ? rgb[i] : w;
+    }
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        out[i] = colorLevel(rgb[i] - w);
+    }
+
+    out[3] = colorLevel(w);
+
+    fadeWrite(out, 0x0F);
+}
+
+static void             fold            (const uint16_t *levels, int32_t *rgb)
+{
+    int32_t w = colorLinear(levels[3]);
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        rgb[i] = colorLinear(levels[i]) + w;
+    }
+}
+
+void                    colorFade       (const uint16_t *target,
+                                         uint32_t duration, uint8_t mode)
+{
+    uint16_t now[FADE_CHANNELS];
+    int32_t  rgb[3];
+
+    active = false;
+
+    if (mode != COLOR_HSV && mode != COLOR_OKLCH)
+    {
+        fadeSync(target, duration);
+        return;
+    }
+
+    space = mode;
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        now[ch] = fadeValue(ch);
+    }
+
+    fold(now, rgb);
+    toLch(rgb, &from);
+    fold(target, rgb);
+    toLch(rgb, &to);
+
+    // A grey end has no hue of its own, take the other one's
+    if (from.c < 328)
+    {
+        from.h = to.h;
+    }
+
+    if (to.c < 328)
+    {
+        to.h = from.h;
+    }
+
+    dh     = (int32_t)(to.h - from.h);
+    start  = millis();
+    length = duration;
+    active = true;
+
+    // 2^48 / length, so a step multiplies instead of dividing. Rounded down,
+    // t stays below 1.0 until the end and is off by less than one count
+    rate   = (duration > 0) ? ((uint64_t) 1 << 48) / duration : 0;
+
+#if COLOR_PROFILE
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA;
+#endif
+
+    colorTick();
+}
+
+void                    colorStop       (void)
+{
+    active = false;
+}
+
+boolean                 colorActive     (void)
+{
+    return active;
+}
+
+void                    colorTick       (void)
+{
+    if (!active)
+    {
+        return;
+    }
+
+#if COLOR_PROFILE
+    uint32_t cycles = DWT->CYCCNT;
+#endif
+
+    uint32_t elapsed = millis() - start;
+    int32_t  rgb[3];
+    lch_t    step;
+
+    if (elapsed >= length)
+    {
+        active = false;
+        step   = to;
+    }
+    else
+    {
+        int32_t t = (elapsed * rate) >> 32;
+
+        step.l = from.l + (((int64_t)(to.l - from.l) * t) >> 16);
+        step.c = from.c + (((int64_t)(to.c - from.c) * t) >> 16);
+        step.h = from.h + (int32_t)(((int64_t) dh * t) >> 16);
+    }
+
+    toRgb(&step, rgb);
+    emit(rgb);
+
+#if COLOR_PROFILE
+    cycles = DWT->CYCCNT - cycles;
+
+    cyclesAvg16 += cycles - (cyclesAvg16 >> 4);
+
+    if (cycles > cyclesMax)
+    {
+        cyclesMax = cycles;
+    }
+#endif
+}
+
+void                    colorTickLoad   (uint32_t *avgCycles,
+                                         uint32_t *maxCycles)
+{
+    if (avgCycles != NULL)
+    {
+        *avgCycles = cyclesAvg16 >> 4;
+    }
+
+    if (maxCycles != NULL)
+    {
+        *maxCycles = cyclesMax;
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include "application.h"
+#include "fade.h"
+
+// Measure colorTick() with the DWT cycle counter, see colorTickLoad()
+#ifndef COLOR_PROFILE
+#define COLOR_PROFILE 1
+#endif
+
+// Colour fade interpolation spaces ////////////////////////////////////////////
+
+const uint8_t COLOR_RGB =               0   /* per channel (fade engine)      */;
+const uint8_t COLOR_HSV =               1   /* hue arc, cheap                 */;
+const uint8_t COLOR_OKLCH =             2   /* OKLab lightness/chroma/hue arc */;
+
+/*******************************************************************************
+ * Function Name  : colorFade
+ * Description    : Fades the RGBW channels (fade channels 0-3) to a target
+ *                  through a colour space, so saturated colours keep their
+ *                  saturation on the way instead of passing through grey. W
+ *                  is folded into RGB as white, and on the way out the white
+ *                  part of every step (min of R, G, B in linear light) is
+ *                  moved back onto W. Returns immediately, see colorTick().
+ * Input          : Target levels (R, G, B, W: 0-65535), Duration in ms,
+ *                  COLOR_HSV / COLOR_OKLCH (COLOR_RGB: plain fadeSync())
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    colorFade       (const uint16_t *target,
+                                         uint32_t duration, uint8_t space)      ;
+
+/*******************************************************************************
+ * Function Name  : colorStop
+ * Description    : Stops the colour fade, channels keep their current values
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    colorStop       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : colorActive
+ * Description    : Tells whether a colour fade is running
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while fading
+ *******************************************************************************/
+
+boolean                 colorActive     (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : colorTick
+ * Description    : Computes the current step in integer math (no float, no
+ *                  divide; the cost is measured, see colorTickLoad()) and
+ *                  writes it through fadeWrite(). Call on every pass of
+ *                  loop().
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    colorTick       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : colorTickLoad
+ * Description    : Cost of the colorTick() steps, measured with the DWT
+ *                  cycle counter (COLOR_PROFILE)
+ * Input          : None.
+ * Output         : Average (EMA, 1/16) and worst cycles per step
+ * Return         : None
+ *******************************************************************************/
+
+void                    colorTickLoad   (uint32_t *avgCycles,
+                                         uint32_t *maxCycles)                   ;
+
+/*******************************************************************************
+ * Function Name  : colorLinear / colorLevel
+ * Description    : Channel level (CIE1931 lightness, as setPWM16() takes it)
+ *                  to linear light in Q15 (32768 = full) and back
+ * Input          : Level (0-65535) / Linear light (Q15)
+ * Output         : None.
+ * Return         : Linear light (Q15) / Level, clamped
+ *******************************************************************************/
+
+int32_t                 colorLinear     (uint16_t level)                        ;
+uint16_t                colorLevel      (int32_t linear)                        ;
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "application.h"
+
+// Event types /////////////////////////////////////////////////////////////////
+
+const uint8_t EVENT_MOTION =            1   /* PIR rising edge                */;
+const uint8_t EVENT_ALERT =             2   /* "alerts" subscription          */;
+
+typedef struct
+{
+    uint8_t     type        ;   // EVENT_*
+    uint8_t     arg         ;   // Type specific
+    uint32_t    time        ;   // millis() when it happened
+} Event                                                                         ;
+
+// Single producer / single consumer ring of Events. One context pushes (an
+// interrupt, or the alert handler), loop() pops. Each side only writes its
+// own index, so neither needs to lock or mask interrupts. Slots are volatile
+// and a barrier orders them before the index that publishes them. One slot
+// stays free to tell full from empty; N must be a power of two and holds
+// N - 1 events.
+
+template <uint8_t N>
+class EventQueue
+{
+    public:
+
+        EventQueue                      ()
+                                        : head(0), tail(0), lost(0)             {}
+
+        /***********************************************************************
+         * Function Name  : push
+         * Description    : Queues an event, producer side only. Safe from
+         *                  interrupts, never blocks
+         * Input          : Type, Argument, Timestamp
+         * Output         : None.
+         * Return         : false (and the overflow counter bumped) if full
+         ***********************************************************************/
+
+        boolean         push            (uint8_t type, uint8_t arg,
+                                         uint32_t time)
+        {
+            uint8_t h = head;
+            uint8_t next = (h + 1) & (N - 1);
+
+            if (next == tail)
+            {
+                lost++;
+                return false;
+            }
+
+            ring[h].type = type;
+            ring[h].arg  = arg;
+            ring[h].time = time;
+
+            __DMB();
+            head = next;
+
+            return true;
+        }
+
+        /***********************************************************************
+         * Function Name  : pop
+         * Description    : Takes the oldest event, consumer side only
+         * Input          : None.
+         * Output         : Event
+         * Return         : false if the queue is empty
+         ***********************************************************************/
+
+        boolean         pop             (Event &e)
+        {
+            uint8_t t = tail;
+
+            if (t == head)
+            {
+                return false;
+            }
+
+            e.type = ring[t].type;
+            e.arg  = ring[t].arg;
+            e.time = ring[t].time;
+
+            __DMB();
+            tail = (t + 1) & (N - 1);
+
+            return true;
+        }
+
+        /***********************************************************************
+         * Function Name  : dropped
+         * Description    : Events lost because the queue was full
+         * Input          : None.
+         * Output         : None.
+         * Return         : Overflow count since start
+         ***********************************************************************/
+
+        uint32_t        dropped         (void) const    { return lost; }
+
+    private:
+
+        static_assert   ((N & (N - 1)) == 0 && N >= 2,
+                         "EventQueue size must be a power of two")              ;
+
+        volatile Event      ring[N]                                             ;
+        volatile uint8_t    head                                                ;
+        volatile uint8_t    tail                                                ;
+        volatile uint32_t   lost                                                ;
+};
+
+#endif
@@ -0,0 +1,372 @@
+/*
+Non-blocking per-channel fade engine. Each channel fades linearly from the
+value it had when the command arrived to its target. Steps are generated
+Bresenham style: the per-millisecond slope is split once into an integer
+part and a remainder, every elapsed millisecond adds the remainder to an
+error term and each time it reaches the duration the value moves one more
+count. No float, no per-tick divide, and a late tick never slows a fade
+down, it just catches up. Long synchronized fades and breathing are played
+by DMA instead; the tick then only mirrors the stream into the values.
+The values are what was requested: every frame goes through the fixture
+calibration (calib.h) on its way to the outputs, all channels at once since
+the correction mixes them.
+A ramp can be armed ahead of time (primed in the stream) for an interrupt
+to fire. The engine doesn't hear about it, it notices the stream running
+the next time it looks and from then on treats it like any DMA fade.
+*/
+
+#include "fade.h"
+#include "pwm.h"
+#include "stream.h"
+#include "calib.h"
+
+typedef struct
+{
+    PwmChannel *pwm                                                             ;
+    int        *value                                                           ;
+    uint16_t    to                                                              ;
+    int8_t      dir                                                             ;
+    uint32_t    quot                                                            ;
+    uint32_t    rem                                                             ;
+    uint64_t    err                                                             ;
+    uint32_t    start                                                           ;
+    uint32_t    last                                                            ;
+    uint32_t    duration                                                        ;
+    boolean     active                                                          ;
+} fade_t                                                                        ;
+
+static void             fadeSetup       (fade_t *f, uint16_t target,
+                                         uint32_t now, uint32_t duration)       ;
+
+static fade_t           fades           [FADE_CHANNELS]                         ;
+
+// All channels, so every tick reaches the outputs as one frame
+static PwmGroup         frame                                                   ;
+
+// All channels are being played by DMA
+static boolean          streamed        =               false                   ;
+
+// A primed ramp waits for fadeFire()
+static boolean          armed           =               false                   ;
+
+// Calibrates the current values and hands them to the PWM as one frame
+static void             fadeCommit      (void)
+{
+    uint16_t out[FADE_CHANNELS];
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        out[ch] = *fades[ch].value;
+    }
+
+    calibApply(out, out);
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        out[ch] = fades[ch].pwm->stage(out[ch]);
+    }
+
+    // Staged above, committed together at the next update event
+    frame.hold();
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        fades[ch].pwm->write(out[ch]);
+    }
+
+    frame.release();
+}
+
+// Notices a ramp fired since the last look, it's a DMA fade from now on
+static void             fadeCatchUp     (void)
+{
+    if (armed && !streamPrimed())
+    {
+        armed    = false;
+        streamed = true;
+    }
+}
+
+// Drops the armed ramp, unless it has just been fired
+static void             fadeDisarm      (void)
+{
+    if (armed)
+    {
+        armed    = false;
+        streamed = !streamDisarm();
+    }
+}
+
+// Takes the channels back from DMA playback, where it is right now
+static void             fadeUnstream    (void)
+{
+    fadeDisarm();
+
+    if (!streamed)
+    {
+        return;
+    }
+
+    streamStop();
+    streamed = false;
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        *fades[ch].value = streamLevel(ch);
+    }
+}
+
+void                    fadeInit        (uint8_t ch, PwmChannel *pwm, int *value)
+{
+    fade_t *f = &fades[ch];
+
+    f->pwm      = pwm;
+    frame.add(pwm);
+    streamAttach(ch, pwm);
+    f->value    = value;
+    f->to       = *value;
+    f->active   = false;
+}
+
+static void             fadeSetup       (fade_t *f, uint16_t target,
+                                         uint32_t now, uint32_t duration)
+{
+    // Preempt whatever is running, continuing from where we are right now
+    uint16_t from = *f->value;
+    uint32_t delta = (target > from) ? target - from : from - target;
+
+    f->to       = target;
+    f->dir      = (target > from) ? 1 : -1;
+    f->err      = 0;
+    f->start    = now;
+    f->last     = now;
+    f->duration = duration;
+    f->active   = (delta != 0);
+
+    // A jump only sets the value, the caller commits the frame
+    if (f->active && duration == 0)
+    {
+        *f->value = target;
+        f->active = false;
+        return;
+    }
+
+    // Counts per ms, split once so the tick needs no divide
+    if (f->active)
+    {
+        f->quot = delta / duration;
+        f->rem  = delta % duration;
+    }
+}
+
+void                    fadeStart       (uint8_t ch, uint16_t target, uint32_t duration)
+{
+    fadeUnstream();
+    fadeSetup(&fades[ch], target, millis(), duration);
+    fadeCommit();
+}
+
+void                    fadeSync        (const uint16_t *targets, uint32_t duration)
+{
+    // Same start and duration on every channel, so they arrive together and
+    // the colour keeps its hue on the way
+    uint32_t now = millis();
+
+    fadeUnstream();
+
+    if (duration >= FADE_STREAM_MS)
+    {
+        uint16_t from[FADE_CHANNELS];
+
+        for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+        {
+            from[ch] = *fades[ch].value;
+            fades[ch].active = false;
+        }
+
+        if (streamRamp(from, targets, duration, false))
+        {
+            streamed = true;
+            return;
+        }
+    }
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        fadeSetup(&fades[ch], targets[ch], now, duration);
+    }
+
+    fadeCommit();
+}
+
+boolean                 fadeBreathe     (const uint16_t *targets, uint32_t duration)
+{
+    uint16_t from[FADE_CHANNELS];
+
+    fadeUnstream();
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        from[ch] = *fades[ch].value;
+        fades[ch].active = false;
+    }
+
+    streamed = streamRamp(from, targets, duration, true);
+    return streamed;
+}
+
+void                    fadeWrite       (const uint16_t *values, uint8_t mask)
+{
+    fadeUnstream();
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        if (mask & (1 << ch))
+        {
+            fades[ch].active = false;
+            *fades[ch].value = values[ch];
+        }
+    }
+
+    fadeCommit();
+}
+
+boolean                 fadeArm         (const uint16_t *targets, uint32_t duration)
+{
+    uint16_t from[FADE_CHANNELS];
+
+    fadeDisarm();
+
+    if (streamed)
+    {
+        return false;
+    }
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        if (fades[ch].active)
+        {
+            return false;
+        }
+
+        from[ch] = *fades[ch].value;
+    }
+
+    armed = streamPrime(from, targets, duration);
+    return armed;
+}
+
+boolean                 fadeFire        (void)
+{
+    return streamFire();
+}
+
+boolean                 fadeArmed       (void)
+{
+    fadeCatchUp();
+    return armed;
+}
+
+void                    fadeRefresh     (void)
+{
+    // An armed ramp holds frames for the old calibration and PWM rate
+    fadeDisarm();
+
+    // A stream picks the change up with the next buffer half by itself
+    if (!streamed)
+    {
+        fadeCommit();
+    }
+}
+
+uint16_t                fadeValue       (uint8_t ch)
+{
+    fadeCatchUp();
+
+    // Ahead of the last tick's mirror, the way fadeUnstream() takes it
+    if (streamed)
+    {
+        return streamLevel(ch);
+    }
+
+    return *fades[ch].value;
+}
+
+void                    fadeStop        (uint8_t ch)
+{
+    fadeUnstream();
+    fades[ch].active = false;
+}
+
+boolean                 fadeActive      (uint8_t ch)
+{
+    fadeCatchUp();
+    return fades[ch].active || streamed;
+}
+
+void                    fadeTick        (void)
+{
+    uint32_t now = millis();
+    boolean  dirty = false;
+
+    fadeCatchUp();
+
+    if (streamed)
+    {
+        // DMA drives the outputs, keep the values (ledR...) up to date
+        for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+        {
+            *fades[ch].value = streamLevel(ch);
+        }
+
+        streamed = streamActive();
+        return;
+    }
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        fade_t *f = &fades[ch];
+
+        if (!f->active)
+        {
+            continue;
+        }
+
+        int32_t v = *f->value;
+
+        if (now - f->start >= f->duration)
+        {
+            v = f->to;
+            f->active = false;
+        }
+        else
+        {
+            uint32_t dt = now - f->last;
+            uint32_t steps = f->quot * dt;
+
+            // Accumulate the remainder per elapsed ms, one extra count each
+            // time it reaches the duration
+            f->err += (uint64_t) f->rem * dt;
+            f->last = now;
+
+            while (f->err >= f->duration)
+            {
+                f->err -= f->duration;
+                steps++;
+            }
+
+            v += f->dir * (int32_t) steps;
+        }
+
+        if (v != *f->value)
+        {
+            *f->value = v;
+            dirty = true;
+        }
+    }
+
+    if (dirty)
+    {
+        fadeCommit();
+    }
+}
@@ -0,0 +1,174 @@
+#ifndef FADE_H
+#define FADE_H
+
+#include "application.h"
+#include "pwm.h"
+
+// Number of independently faded PWM channels //////////////////////////////////
+
+const uint8_t FADE_CHANNELS =           4                                       ;
+
+// fadeSync() hands fades this long (ms) or longer to DMA playback /////////////
+
+const uint16_t FADE_STREAM_MS =         1000                                    ;
+
+/*******************************************************************************
+ * Function Name  : fadeInit
+ * Description    : Binds a fade channel to a PWM output and the variable that
+ *                  mirrors its current 16 bit value (e.g. ledR)
+ * Input          : Channel, PwmChannel (begin() done), Pointer to value
+ *                  (0-65535)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeInit        (uint8_t ch, PwmChannel *pwm,
+                                         int *value)                            ;
+
+/*******************************************************************************
+ * Function Name  : fadeStart
+ * Description    : Fades a channel to target within duration (ms) and returns
+ *                  immediately. A running fade is preempted and the new one
+ *                  starts from the current value, so the last command wins.
+ * Input          : Channel, Target value (0-65535), Duration in ms (0: jump)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeStart       (uint8_t ch, uint16_t target,
+                                         uint32_t duration)                     ;
+
+/*******************************************************************************
+ * Function Name  : fadeSync
+ * Description    : Fades all FADE_CHANNELS channels to their targets over the
+ *                  same duration (ms), so they arrive together and the colour
+ *                  doesn't shift hue mid-fade. Preempts like fadeStart().
+ *                  From FADE_STREAM_MS on the fade is played by DMA (see
+ *                  stream.h) and fadeTick() only mirrors the values.
+ * Input          : Targets (one per channel, 0-65535), Duration in ms
+ *                  (0: jump)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeSync        (const uint16_t *targets,
+                                         uint32_t duration)                     ;
+
+/*******************************************************************************
+ * Function Name  : fadeBreathe
+ * Description    : Fades all channels back and forth between their current
+ *                  values and targets until preempted, played by DMA
+ * Input          : Targets (one per channel, 0-65535), Duration of one way
+ *                  in ms
+ * Output         : None.
+ * Return         : false if DMA playback isn't available for the channels
+ *******************************************************************************/
+
+boolean                 fadeBreathe     (const uint16_t *targets,
+                                         uint32_t duration)                     ;
+
+/*******************************************************************************
+ * Function Name  : fadeWrite
+ * Description    : Sets the masked channels right away as one PWM frame,
+ *                  ending their fades (for players computing their own curve)
+ * Input          : Values (one per channel, 0-65535), Channel mask (bit 0:
+ *                  channel 0...)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeWrite       (const uint16_t *values, uint8_t mask)  ;
+
+/*******************************************************************************
+ * Function Name  : fadeArm
+ * Description    : Prepares a synchronized fade to targets that fadeFire()
+ *                  starts later, from an interrupt, without going through
+ *                  loop() (see streamPrime()). It plays by DMA from the
+ *                  values as they are now, so only arm while nothing fades;
+ *                  any other fade call disarms it. Once fired it is a DMA
+ *                  fade like fadeSync()'s, preempted the same way.
+ * Input          : Targets (one per channel, 0-65535), Duration in ms
+ * Output         : None.
+ * Return         : false if a fade is running or DMA playback isn't
+ *                  available
+ *******************************************************************************/
+
+boolean                 fadeArm         (const uint16_t *targets,
+                                         uint32_t duration)                     ;
+
+/*******************************************************************************
+ * Function Name  : fadeFire
+ * Description    : Starts the armed fade, the outputs change right away.
+ *                  Interrupt safe, never blocks.
+ * Input          : None.
+ * Output         : None.
+ * Return         : false if nothing was armed
+ *******************************************************************************/
+
+boolean                 fadeFire        (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : fadeArmed
+ * Description    : Tells whether an armed fade is still waiting
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while armed and not fired
+ *******************************************************************************/
+
+boolean                 fadeArmed       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : fadeRefresh
+ * Description    : Writes the current values to the outputs again, e.g.
+ *                  after the calibration or the PWM rate changed. Drops an
+ *                  armed fade, its frames are stale.
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeRefresh     (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : fadeValue
+ * Description    : Current value of a channel
+ * Input          : Channel
+ * Output         : None.
+ * Return         : Value (0-65535)
+ *******************************************************************************/
+
+uint16_t                fadeValue       (uint8_t ch)                            ;
+
+/*******************************************************************************
+ * Function Name  : fadeStop
+ * Description    : Freezes a channel at its current value (a DMA played
+ *                  fade or breathing stops on all channels)
+ * Input          : Channel
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeStop        (uint8_t ch)                            ;
+
+/*******************************************************************************
+ * Function Name  : fadeActive
+ * Description    : Tells whether a channel is still fading
+ * Input          : Channel
+ * Output         : None.
+ * Return         : true while the fade is in progress
+ *******************************************************************************/
+
+boolean                 fadeActive      (uint8_t ch)                            ;
+
+/*******************************************************************************
+ * Function Name  : fadeTick
+ * Description    : Advances all running fades to the current time and updates
+ *                  the PWM outputs. Call on every pass of loop().
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    fadeTick        (void)                                  ;
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef GAMMA_H
+#define GAMMA_H
+
+#include <stdint.h>
+
+// Perceptual brightness correction ////////////////////////////////////////////
+//
+// CIE 1931 lightness (L*) to relative luminance (Y), evaluated entirely at
+// compile time. The generated table maps an 8-bit perceptual level straight
+// to a timer compare value, so the PWM hot path is a single table load.
+
+namespace gamma_lut
+{
+    // Index sequence (std::index_sequence is C++14, the toolchain is C++11)
+
+    template <uint16_t... I> struct seq {};
+
+    template <uint16_t N, uint16_t... I>
+    struct make_seq : make_seq<N - 1, N - 1, I...> {};
+
+    template <uint16_t... I>
+    struct make_seq<0, I...> { typedef seq<I...> type; };
+
+    // Y = L / 902.3 below L* 8, ((L + 16) / 116)^3 above (L in 0..100)
+
+    constexpr double cube       (double x)
+    {
+        return x * x * x;
+    }
+
+    constexpr double cie1931    (double L)
+    {
+        return L <= 8.0 ? L / 902.3 : cube((L + 16.0) / 116.0);
+    }
+
+    constexpr uint16_t entry    (uint16_t i, uint32_t top)
+    {
+        return (uint16_t)(cie1931(100.0 * i / 255.0) * top + 0.5);
+    }
+}
+
+struct GammaLUT
+{
+    uint16_t v[256];
+};
+
+/*******************************************************************************
+ * Function Name  : makeGammaLUT
+ * Description    : Builds the 256 entry CIE1931 table at compile time, entry i
+ *                  being the compare value for perceptual level i / 255 on a
+ *                  timer counting 0..top-1 (top = TIM_ARR + 1)
+ * Input          : top, gamma_lut::make_seq<256>::type()
+ * Output         : None.
+ * Return         : GammaLUT (constexpr)
+ *******************************************************************************/
+
+template <uint16_t... I>
+constexpr GammaLUT      makeGammaLUT    (uint32_t top, gamma_lut::seq<I...>)
+{
+    return GammaLUT {{ gamma_lut::entry(I, top)... }};
+}
+
+#endif
@@ -0,0 +1,469 @@
+/*
+Free running ambient light acquisition. ADC1 converts one channel
+continuously and DMA1 Channel 1 writes the results into a circular buffer;
+the CPU only sees the half-transfer and transfer-complete interrupts (every
+~0.7 ms) and adds up the half that was just filled. Every LUX_BLOCK halves
+the sum is decimated to 16 bit (Q4 counts, the extra bits come from
+averaging ~1000 noisy samples), a median of three blocks drops single
+spikes and an exponential filter (1/4 per block) smooths the rest. Readers
+get the last result without touching the ADC.
+
+The sensor sits next to the LEDs. luxSync() moves the conversions to the end
+of every PWM period, where all channels below full duty are off, and a
+learned table of what each channel adds at its current duty (8 points,
+linear in between) is taken off every block before filtering. The table
+covers what the sample point can't: full duty, and the sensor's tail when a
+channel switched off just before.
+*/
+
+#include "lux.h"
+
+static volatile uint16_t samples        [LUX_SAMPLES]                           ;
+
+static uint32_t         sum                                                     ;
+static uint8_t          halves                                                  ;
+static uint8_t          blockHalves     =               LUX_BLOCK               ;
+static uint16_t         block           [3]                                     ;
+static uint8_t          slot                                                    ;
+static uint8_t          filled                                                  ;
+static uint32_t         smooth                                                  ;
+static volatile uint16_t counts         =               0                       ;
+
+// PWM timer the self light comes from, sample point follows its period
+static uint8_t          adcChannel                                              ;
+static TIM_TypeDef     *tim             =               NULL                    ;
+static boolean          synced          =               false                   ;
+static uint16_t         arr                                                     ;
+static uint16_t         psc                                                     ;
+
+// Self light per CCR slot of tim, counts / 16 at duty 1/8 ... 8/8
+static uint8_t          table           [4][LUX_POINTS]                         ;
+static volatile boolean known           =               false                   ;
+static volatile uint16_t self           =               0                       ;
+static volatile uint16_t lamp           =               0                       ;
+
+// Learning, advanced one block at a time from the interrupt
+static PwmChannel      *learnCh         [4]                                     ;
+static uint8_t          learnSlot       [4]                                     ;
+static uint8_t          learnN                                                  ;
+static uint8_t          learnIdx                                                ;
+static uint8_t          learnStep                                               ;
+static uint8_t          learnBlocks                                             ;
+static uint32_t         learnAcc                                                ;
+static uint16_t         learnBase                                               ;
+static volatile boolean learning        =               false                   ;
+
+static uint16_t         median3         (uint16_t a, uint16_t b, uint16_t c)
+{
+    if (a > b)
+    {
+        uint16_t t = a;
+        a = b;
+        b = t;
+    }
+
+    // a <= b: the median is b, a or c
+    return (c > b) ? b : ((c < a) ? a : c);
+}
+
+// Own light in the reading at the duty the channels have now (Q4 counts)
+static uint16_t         selfLight       (void)
+{
+    uint32_t top   = tim->ARR + 1;
+    uint32_t total = 0;
+
+    for (uint8_t s = 0; s < 4; s++)
+    {
+        uint32_t d = (uint32_t)(&tim->CCR1)[s * 2] * (LUX_POINTS << 8) / top;
+
+        if (d >= (LUX_POINTS << 8))
+        {
+            total += table[s][LUX_POINTS - 1] << 8;
+            continue;
+        }
+
+        uint8_t k  = d >> 8;
+        int32_t lo = k ? table[s][k - 1] : 0;
+        int32_t hi = table[s][k];
+
+        total += (lo << 8) + (hi - lo) * (int32_t)(d & 0xFF);
+    }
+
+    return (total > 0xFFFF) ? 0xFFFF : total;
+}
+
+// Average light the channels add over the period (Q4 counts): the full duty
+// point is the channel on all the time, scaled by the duty it has now
+static uint16_t         lampLight       (void)
+{
+    uint32_t top   = tim->ARR + 1;
+    uint32_t total = 0;
+
+    for (uint8_t s = 0; s < 4; s++)
+    {
+        uint32_t ccr = (&tim->CCR1)[s * 2];
+
+        ccr    = (ccr > top) ? top : ccr;
+        total += ((uint32_t) table[s][LUX_POINTS - 1] << 8) * ccr / top;
+    }
+
+    return (total > 0xFFFF) ? 0xFFFF : total;
+}
+
+// Keeps the sample point at the end of the PWM period and blocks ~20 ms long
+static void             retime          (void)
+{
+    if (!synced || (tim->ARR == arr && tim->PSC == psc))
+    {
+        return;
+    }
+
+    arr = tim->ARR;
+    psc = tim->PSC;
+
+    // Sampling and conversion (28.5 + 12.5 ADC clocks, ~3.5 us) end at the
+    // update event
+    uint16_t lead = (SystemCoreClock / 280000) / (psc + 1) + 1;
+
+    TIM2->PSC  = psc;
+    TIM2->CCR2 = (arr + 1 > lead) ? arr + 1 - lead : 0;
+
+    uint32_t n = pwmGetFrequency(tim) / (LUX_SAMPLES / 2 * 50);
+
+    blockHalves = (n < 1) ? 1 : ((n > 255) ? 255 : n);
+}
+
+static void             learnNext       (uint16_t value)
+{
+    if (++learnBlocks <= LUX_LEARN_SETTLE)
+    {
+        return;
+    }
+
+    learnAcc += value;
+
+    if (learnBlocks < LUX_LEARN_SETTLE + LUX_LEARN_AVERAGE)
+    {
+        return;
+    }
+
+    uint16_t mean = learnAcc / LUX_LEARN_AVERAGE;
+
+    learnAcc    = 0;
+    learnBlocks = 0;
+
+    // Step 0 is the baseline with everything off, then duty 1/8 ... 8/8
+    if (learnStep == 0)
+    {
+        learnBase = mean;
+    }
+    else
+    {
+        int32_t d = ((int32_t) mean - learnBase) >> 8;
+
+        table[learnSlot[learnIdx]][learnStep - 1] = (d < 0) ? 0 : ((d > 255) ? 255 : d);
+    }
+
+    if (++learnStep > LUX_POINTS)
+    {
+        learnCh[learnIdx]->write(0);
+        learnStep = 0;
+
+        if (++learnIdx >= learnN)
+        {
+            known    = true;
+            learning = false;
+            return;
+        }
+    }
+
+    learnCh[learnIdx]->write((uint32_t)(tim->ARR + 1) * learnStep / LUX_POINTS);
+}
+
+extern "C" void         DMA1_Channel1_IRQHandler(void)
+{
+    uint32_t isr = DMA1->ISR;
+
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+
+    // The half that was just filled, the DMA is on the other one now
+    uint8_t first = (isr & DMA_ISR_TCIF1) ? LUX_SAMPLES / 2 : 0;
+
+    for (uint8_t i = first; i < first + LUX_SAMPLES / 2; i++)
+    {
+        sum += samples[i];
+    }
+
+    retime();
+
+    if (++halves < blockHalves)
+    {
+        return;
+    }
+
+    uint16_t value = (sum << 4) / (halves * (LUX_SAMPLES / 2));
+
+    sum    = 0;
+    halves = 0;
+
+    if (learning)
+    {
+        learnNext(value);
+        return;
+    }
+
+    if (tim != NULL)
+    {
+        uint16_t s = selfLight();
+
+        value = (value > s) ? value - s : 0;
+        self  = s;
+        lamp  = lampLight();
+    }
+
+    block[slot] = value;
+    slot        = (slot + 1) % 3;
+
+    // The first block seeds the filter, until three are in there is no median
+    if (filled < 3)
+    {
+        smooth = (filled++ == 0) ? (uint32_t) value << 4 : smooth;
+    }
+    else
+    {
+        value = median3(block[0], block[1], block[2]);
+    }
+
+    // Exponential filter, Q4 on top of the Q4 counts for rounding
+    smooth += ((int32_t)((uint32_t) value << 4) - (int32_t) smooth) >> 2;
+    counts  = smooth >> 4;
+}
+
+boolean                 luxBegin        (uint8_t pin)
+{
+    if (pin >= TOTAL_PINS || PIN_MAP[pin].adc_channel == NONE)
+    {
+        return false;
+    }
+
+    uint8_t ch = PIN_MAP[pin].adc_channel;
+
+    adcChannel = ch;
+    luxLoad();
+
+    pinMode(pin, AN_INPUT);
+
+    RCC_ADCCLKConfig(RCC_PCLK2_Div6);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_ADC1, ENABLE);
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+    // Independent mode (analogRead() leaves ADC1 in dual mode), one channel
+    ADC1->CR2  = 0;
+    ADC1->CR1  = 0;
+    ADC1->SQR1 = 0;
+    ADC1->SQR3 = ch;
+
+    // Longest sample time, 239.5 + 12.5 ADC clocks (12 MHz) per conversion
+    if (ch < 10)
+    {
+        ADC1->SMPR2 |= 7 << (3 * ch);
+    }
+    else
+    {
+        ADC1->SMPR1 |= 7 << (3 * (ch - 10));
+    }
+
+    DMA1_Channel1->CCR   = 0;
+    DMA1->IFCR           = DMA_IFCR_CGIF1;
+    DMA1_Channel1->CPAR  = (uint32_t) &ADC1->DR;
+    DMA1_Channel1->CMAR  = (uint32_t) samples;
+    DMA1_Channel1->CNDTR = LUX_SAMPLES;
+    DMA1_Channel1->CCR   = DMA_CCR1_CIRC | DMA_CCR1_MINC | DMA_CCR1_PSIZE_0 |
+                           DMA_CCR1_MSIZE_0 | DMA_CCR1_HTIE | DMA_CCR1_TCIE;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 12;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    DMA1_Channel1->CCR  |= DMA_CCR1_EN;
+
+    // Power up (t_STAB 1 us), calibrate, then start converting for good
+    ADC1->CR2 = ADC_CR2_ADON;
+    delayMicroseconds(2);
+
+    ADC1->CR2 |= ADC_CR2_RSTCAL;
+    while (ADC1->CR2 & ADC_CR2_RSTCAL);
+
+    ADC1->CR2 |= ADC_CR2_CAL;
+    while (ADC1->CR2 & ADC_CR2_CAL);
+
+    ADC1->CR2 |= ADC_CR2_CONT | ADC_CR2_DMA | ADC_CR2_EXTSEL | ADC_CR2_EXTTRIG;
+    ADC1->CR2 |= ADC_CR2_SWSTART;
+
+    return true;
+}
+
+boolean                 luxSync         (TIM_TypeDef *pwm)
+{
+    // TIM2's internal trigger inputs: ITR2 = TIM3, ITR3 = TIM4 TRGO
+    uint8_t itr = (pwm == TIM3) ? 2 : ((pwm == TIM4) ? 3 : 0);
+
+    if (itr == 0)
+    {
+        return false;
+    }
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
+
+    // PWM timer: TRGO on update (MMS = 010)
+    pwm->CR2 = (pwm->CR2 & ~0x0070) | (2 << 4);
+
+    // TIM2: reset by that TRGO (SMS = 100), CH2 compare (PWM mode 1) is
+    // the ADC trigger. The pin (A1) stays an input, only the event is used
+    TIM2->CR1   = 0;
+    TIM2->ARR   = 0xFFFF;
+    TIM2->CCMR1 = (TIM2->CCMR1 & 0x00FF) | (6 << 12);
+    TIM2->CCER |= 1 << 4;
+    TIM2->SMCR  = (itr << 4) | 4;
+
+    __disable_irq();
+
+    tim    = pwm;
+    synced = true;
+    arr    = 0;
+    retime();
+    sum    = 0;
+    halves = 0;
+
+    __enable_irq();
+
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->CR1 = TIM_CR1_CEN;
+
+    // ADC: stop free running, short sample time (28.5 clocks), TIM2 CC2
+    // external trigger (EXTSEL = 011)
+    ADC1->CR2 &= ~ADC_CR2_CONT;
+
+    if (adcChannel < 10)
+    {
+        ADC1->SMPR2 = (ADC1->SMPR2 & ~(7 << (3 * adcChannel))) | (3 << (3 * adcChannel));
+    }
+    else
+    {
+        ADC1->SMPR1 = (ADC1->SMPR1 & ~(7 << (3 * (adcChannel - 10)))) |
+                      (3 << (3 * (adcChannel - 10)));
+    }
+
+    ADC1->CR2 = (ADC1->CR2 & ~ADC_CR2_EXTSEL) | (3 << 17) | ADC_CR2_EXTTRIG;
+
+    return true;
+}
+
+boolean                 luxLearn        (PwmChannel **ch, uint8_t n)
+{
+    if (tim == NULL || n == 0 || n > 4)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        if (ch[i]->timer() != tim)
+        {
+            return false;
+        }
+    }
+
+    learning = false;
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        learnCh[i]   = ch[i];
+        learnSlot[i] = ((uint32_t) ch[i]->reg() - (uint32_t) &tim->CCR1) >> 2;
+        ch[i]->write(0);
+    }
+
+    learnN      = n;
+    learnIdx    = 0;
+    learnStep   = 0;
+    learnBlocks = 0;
+    learnAcc    = 0;
+    learning    = true;
+
+    return true;
+}
+
+boolean                 luxLearning     (void)
+{
+    return learning;
+}
+
+boolean                 luxKnown        (void)
+{
+    return known;
+}
+
+boolean                 luxLoad         (void)
+{
+    uint8_t loaded[4][LUX_POINTS];
+    uint8_t sum = LUX_MAGIC;
+
+    if (EEPROM.read(LUX_EEPROM_ADDR) != LUX_MAGIC)
+    {
+        return false;
+    }
+
+    for (uint8_t k = 0; k < 4 * LUX_POINTS; k++)
+    {
+        loaded[k / LUX_POINTS][k % LUX_POINTS] = EEPROM.read(LUX_EEPROM_ADDR + 1 + k);
+        sum += loaded[k / LUX_POINTS][k % LUX_POINTS];
+    }
+
+    if (EEPROM.read(LUX_EEPROM_ADDR + 1 + 4 * LUX_POINTS) != sum)
+    {
+        return false;
+    }
+
+    memcpy(table, loaded, sizeof(table));
+    known = true;
+    return true;
+}
+
+void                    luxSave         (void)
+{
+    uint8_t sum = LUX_MAGIC;
+
+    EEPROM.write(LUX_EEPROM_ADDR, LUX_MAGIC);
+
+    for (uint8_t k = 0; k < 4 * LUX_POINTS; k++)
+    {
+        EEPROM.write(LUX_EEPROM_ADDR + 1 + k, table[k / LUX_POINTS][k % LUX_POINTS]);
+        sum += table[k / LUX_POINTS][k % LUX_POINTS];
+    }
+
+    EEPROM.write(LUX_EEPROM_ADDR + 1 + 4 * LUX_POINTS, sum);
+}
+
+uint16_t                luxSelf         (void)
+{
+    return ((uint32_t) self * LUX_PER_COUNT) >> 20;
+}
+
+uint16_t                luxLamp         (void)
+{
+    return ((uint32_t) lamp * LUX_PER_COUNT) >> 20;
+}
+
+uint16_t                luxRead         (void)
+{
+    return ((uint32_t) counts * LUX_PER_COUNT) >> 20;
+}
+
+uint16_t                luxCounts       (void)
+{
+    return counts;
+}
@@ -0,0 +1,161 @@
+#ifndef LUX_H
+#define LUX_H
+
+#include "application.h"
+#include "pwm.h"
+
+// ADC samples in the circular DMA buffer, summed half at a time ///////////////
+
+const uint8_t LUX_SAMPLES =             64                                      ;
+
+// Free running, halves per block: 30 x 32 samples at ~21 us = ~20 ms, a ///////
+// whole period of 50 Hz and two of 100 Hz lamp flicker ////////////////////////
+
+const uint8_t LUX_BLOCK =               30                                      ;
+
+// TEMT6000 with 10k: lux per ADC count (0.161172) in Q16 //////////////////////
+
+const uint16_t LUX_PER_COUNT =          10563                                   ;
+
+// Self-light table: points per channel (duty 1/8 ... 8/8), in counts / 16 /////
+
+const uint8_t LUX_POINTS =              8                                       ;
+
+// Learning: blocks to settle and to average at every point ////////////////////
+
+const uint8_t LUX_LEARN_SETTLE =        4                                       ;
+const uint8_t LUX_LEARN_AVERAGE =       8                                       ;
+
+// EEPROM (emulated) layout: magic, 4 x LUX_POINTS bytes, checksum; after //////
+// the colour calibration (calib.h) ////////////////////////////////////////////
+
+const uint8_t LUX_EEPROM_ADDR =         48                                      ;
+const uint8_t LUX_MAGIC =               0x1C                                    ;
+
+/*******************************************************************************
+ * Function Name  : luxBegin
+ * Description    : Starts ADC1 converting the pin continuously (239.5 cycle
+ *                  sample time, ~47.6 kS/s) into a circular buffer through
+ *                  DMA1 Channel 1. The DMA interrupt decimates every block of
+ *                  LUX_BLOCK halves into one 16 bit value, takes the median
+ *                  of the last three blocks and smooths that exponentially,
+ *                  so there is always a fresh, filtered value to read.
+ *                  analogRead() must not be used afterwards, it reprograms
+ *                  ADC1 and the DMA channel.
+ * Input          : Analog pin (A0-A7)
+ * Output         : None.
+ * Return         : false if the pin has no ADC channel
+ *******************************************************************************/
+
+boolean                 luxBegin        (uint8_t pin)                           ;
+
+/*******************************************************************************
+ * Function Name  : luxSync
+ * Description    : Switches from free running to one conversion per PWM
+ *                  period, at the end of the period when every channel
+ *                  below full duty is off. TIM2 is reset by the PWM timer's
+ *                  update event (slave reset mode) and its CC2 event starts
+ *                  the ADC, so the sample point follows frequency changes.
+ *                  TIM2 is taken over, none of its pins may be PWM outputs.
+ * Input          : PWM timer (TIM3 or TIM4)
+ * Output         : None.
+ * Return         : false if the timer can't trigger TIM2
+ *******************************************************************************/
+
+boolean                 luxSync         (TIM_TypeDef *pwm)                      ;
+
+/*******************************************************************************
+ * Function Name  : luxLearn
+ * Description    : Learns what each channel adds to the reading, at 8 duty
+ *                  levels against a baseline with all of them off (about
+ *                  12 blocks per point). Runs from the ADC interrupt and
+ *                  drives the channels' CCRs directly: nothing else may
+ *                  write them until luxLearning() is false. Afterwards the
+ *                  channels are off; luxSave() keeps the table.
+ * Input          : Channels (on the luxSync() timer), Count (up to 4)
+ * Output         : None.
+ * Return         : false if a channel isn't on the timer
+ *******************************************************************************/
+
+boolean                 luxLearn        (PwmChannel **ch, uint8_t n)            ;
+
+/*******************************************************************************
+ * Function Name  : luxLearning
+ * Description    : Tells whether luxLearn() is still running
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while learning
+ *******************************************************************************/
+
+boolean                 luxLearning     (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxKnown
+ * Description    : Tells whether the self-light table holds data, loaded by
+ *                  luxLoad() or learned by a finished luxLearn()
+ * Input          : None.
+ * Output         : None.
+ * Return         : false while the table is all zero
+ *******************************************************************************/
+
+boolean                 luxKnown        (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxLoad / luxSave
+ * Description    : Reads / writes the self-light table from / to EEPROM
+ *                  (luxBegin() loads it)
+ * Input          : None.
+ * Output         : None.
+ * Return         : luxLoad: false (table unchanged) if no valid data
+ *******************************************************************************/
+
+boolean                 luxLoad         (void)                                  ;
+void                    luxSave         (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxSelf
+ * Description    : Own light subtracted from the last block, from the
+ *                  table at the channels' current duty
+ * Input          : None.
+ * Output         : None.
+ * Return         : Lux
+ *******************************************************************************/
+
+uint16_t                luxSelf         (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxLamp
+ * Description    : Light our own channels add on average at their current
+ *                  duty, modelled from the learned full duty readings. What
+ *                  luxRead() leaves out, for control loops that need to see
+ *                  their own output. 0 until luxSync(), and 0 at any duty
+ *                  while luxKnown() is false: a controller closing its loop
+ *                  over this would never see its own light (check first)
+ * Input          : None.
+ * Output         : None.
+ * Return         : Lux
+ *******************************************************************************/
+
+uint16_t                luxLamp         (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxRead
+ * Description    : Filtered ambient light without our own, costs one load
+ * Input          : None.
+ * Output         : None.
+ * Return         : Lux
+ *******************************************************************************/
+
+uint16_t                luxRead         (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : luxCounts
+ * Description    : Filtered ADC reading, oversampled to 16 bit (Q4 counts)
+ * Input          : None.
+ * Output         : None.
+ * Return         : ADC counts << 4
+ *******************************************************************************/
+
+uint16_t                luxCounts       (void)                                  ;
+
+#endif
@@ -0,0 +1,284 @@
+/*
+PIR pulse capture. TIM4 counts microseconds and the update interrupt counts
+its wraps, so every edge gets a 64 bit time stamp from the capture register,
+however late the interrupt runs. Spikes shorter than the input filter are
+never captured at all. A rising edge arms a compare at the minimum width: a
+pulse that has ended by then is rejected, one still high is valid right
+there, without waiting for its falling edge (PIR outputs stay high for
+seconds). Valid pulses go into a short history and the handler only runs
+once N of them started within the window. The minimum width defaults to 0,
+which makes every captured rising edge valid at once: waiting for a width
+would hold the presence light back by as long.
+*/
+
+#include "pir.h"
+
+static void           (*notify)         (void)          =       NULL            ;
+
+// Capture registers and flags: direct channel rising, partner falling
+static volatile uint16_t *ccrRise                                               ;
+static volatile uint16_t *ccrFall                                               ;
+static uint16_t         flagRise                                                ;
+static uint16_t         flagFall                                                ;
+
+static volatile uint32_t wraps          =               0                       ;
+static uint64_t         riseAt                                                  ;
+static uint64_t         acceptedAt                                              ;
+static boolean          high            =               false                   ;
+static boolean          pending         =               false                   ;
+
+// Rising edges of the last valid pulses, oldest overwritten
+static uint64_t         history         [PIR_HISTORY]                           ;
+static uint8_t          next            =               0                       ;
+static uint8_t          stored          =               0                       ;
+
+static uint32_t         minTicks        =               PIR_MIN_WIDTH_MS * 1000 ;
+static uint8_t          needed          =               PIR_COUNT               ;
+static uint32_t         span            =               PIR_WINDOW_MS * 1000    ;
+
+static volatile PirStats stats                                                  ;
+
+// Counter now, a wrap not yet counted included. Capture interrupt only
+static uint64_t         now             (void)
+{
+    uint32_t hi = wraps;
+    uint16_t c  = TIM4->CNT;
+
+    if ((TIM4->SR & TIM_SR_UIF) && c < 0x8000)
+    {
+        hi++;
+    }
+
+    return ((uint64_t) hi << 16) | c;
+}
+
+// Captured value to time stamp; low values were captured after a wrap that
+// this interrupt is handling too
+static uint64_t         stamp           (uint16_t c, uint16_t sr, uint32_t hi)
+{
+    if ((sr & TIM_SR_UIF) && c < 0x8000)
+    {
+        hi++;
+    }
+
+    return ((uint64_t) hi << 16) | c;
+}
+
+static void             valid           (uint64_t t)
+{
+    if (stored != 0)
+    {
+        stats.interval = (t - history[(next + PIR_HISTORY - 1) % PIR_HISTORY]) / 1000;
+    }
+
+    history[next] = t;
+    next          = (next + 1) % PIR_HISTORY;
+    stored        = (stored < PIR_HISTORY) ? stored + 1 : stored;
+
+    // This one counts as the first, the N-th latest must be in the window
+    if (stored < needed ||
+        t - history[(next + PIR_HISTORY - needed) % PIR_HISTORY] > span)
+    {
+        stats.unconfirmed++;
+        return;
+    }
+
+    stats.accepted++;
+    acceptedAt = t;
+
+    if (notify != NULL)
+    {
+        notify();
+    }
+}
+
+static void             rising          (uint64_t t)
+{
+    high   = true;
+    riseAt = t;
+
+    if (minTicks == 0)
+    {
+        valid(t);
+        return;
+    }
+
+    // Matches minTicks after the edge first, wraps only bring it back later
+    pending      = true;
+    TIM4->CCR3   = (uint16_t)(t + minTicks);
+    TIM4->SR     = (uint16_t) ~TIM_SR_CC3IF;
+    TIM4->DIER  |= TIM_DIER_CC3IE;
+}
+
+static void             falling         (uint64_t t)
+{
+    // Already high at pirBegin(), nothing to measure
+    if (!high)
+    {
+        return;
+    }
+
+    uint64_t width = t - riseAt;
+
+    high        = false;
+    stats.width = width / 1000;
+
+    if (pending)
+    {
+        pending      = false;
+        TIM4->DIER  &= (uint16_t) ~TIM_DIER_CC3IE;
+
+        // Wide enough, the compare just hasn't been seen yet
+        if (width >= minTicks)
+        {
+            valid(riseAt);
+        }
+        else
+        {
+            stats.tooShort++;
+        }
+    }
+}
+
+static void             capture         (void)
+{
+    uint16_t sr = TIM4->SR;
+    uint32_t hi = wraps;
+
+    TIM4->SR = (uint16_t) ~(sr & (TIM_SR_UIF | TIM_SR_CC1IF | TIM_SR_CC2IF |
+                                  TIM_SR_CC3IF | TIM_SR_CC1OF | TIM_SR_CC2OF));
+
+    if (sr & TIM_SR_UIF)
+    {
+        wraps = hi + 1;
+    }
+
+    boolean  r  = (sr & flagRise) != 0;
+    boolean  f  = (sr & flagFall) != 0;
+    uint64_t tr = r ? stamp(*ccrRise, sr, hi) : 0;
+    uint64_t tf = f ? stamp(*ccrFall, sr, hi) : 0;
+
+    // Both edges since the last interrupt: in the order they happened
+    if (r && f && tf < tr)
+    {
+        falling(tf);
+        rising(tr);
+    }
+    else
+    {
+        if (r)
+        {
+            rising(tr);
+        }
+
+        if (f)
+        {
+            falling(tf);
+        }
+    }
+
+    // Compare match, or the edge was handled late: still high is valid
+    if (pending && now() - riseAt >= minTicks)
+    {
+        pending      = false;
+        TIM4->DIER  &= (uint16_t) ~TIM_DIER_CC3IE;
+        valid(riseAt);
+    }
+}
+
+boolean                 pirBegin        (uint8_t pin, void (*handler)(void))
+{
+    if (pin >= TOTAL_PINS || PIN_MAP[pin].timer_peripheral != TIM4 ||
+        (PIN_MAP[pin].timer_ch != TIM_Channel_1 &&
+         PIN_MAP[pin].timer_ch != TIM_Channel_2))
+    {
+        return false;
+    }
+
+    boolean one = (PIN_MAP[pin].timer_ch == TIM_Channel_1);
+
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
+
+    TIM4->CR1  = 0;
+    TIM4->DIER = 0;
+
+    __disable_irq();
+
+    notify   = handler;
+    ccrRise  = one ? &TIM4->CCR1 : &TIM4->CCR2;
+    ccrFall  = one ? &TIM4->CCR2 : &TIM4->CCR1;
+    flagRise = one ? TIM_SR_CC1IF : TIM_SR_CC2IF;
+    flagFall = one ? TIM_SR_CC2IF : TIM_SR_CC1IF;
+    wraps    = 0;
+    high     = false;
+    pending  = false;
+    stored   = 0;
+
+    __enable_irq();
+
+    TIM4->PSC  = SystemCoreClock / PIR_TICK_HZ - 1;
+    TIM4->ARR  = 0xFFFF;
+
+    // Both captures on the pin's input (CCxS: 01 direct, 10 the partner's),
+    // filter fDTS / 32, 8 samples (ICxF = 1111). CC3 compares, no output
+    TIM4->CCMR1 = (one ? 0x0201 : 0x0102) | 0xF0F0;
+    TIM4->CCMR2 = 0;
+
+    // Rising on the direct channel, falling (CCxP) on the partner
+    TIM4->CCER  = (1 << 0) | (1 << 4) | (one ? (1 << 5) : (1 << 1));
+
+    Wiring_TIM4_Interrupt_Handler = capture;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    NVIC_InitStructure.NVIC_IRQChannel = TIM4_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 10;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    // Load the prescaler, start clean
+    TIM4->EGR  = TIM_EGR_UG;
+    TIM4->SR   = 0;
+    TIM4->DIER = TIM_DIER_UIE | TIM_DIER_CC1IE | TIM_DIER_CC2IE;
+    TIM4->CR1  = TIM_CR1_CEN;
+
+    return true;
+}
+
+boolean                 pirFilter       (uint16_t width, uint8_t n,
+                                         uint16_t window)
+{
+    if (n < 1 || n > PIR_HISTORY)
+    {
+        return false;
+    }
+
+    __disable_irq();
+
+    minTicks = (uint32_t) width * 1000;
+    needed   = n;
+    span     = (uint32_t) window * 1000;
+
+    __enable_irq();
+
+    return true;
+}
+
+uint32_t                pirAge          (void)
+{
+    return now() - acceptedAt;
+}
+
+void                    pirStats        (PirStats *s)
+{
+    __disable_irq();
+
+    s->accepted    = stats.accepted;
+    s->tooShort    = stats.tooShort;
+    s->unconfirmed = stats.unconfirmed;
+    s->width       = stats.width;
+    s->interval    = stats.interval;
+
+    __enable_irq();
+}
@@ -0,0 +1,90 @@
+#ifndef PIR_H
+#define PIR_H
+
+#include "application.h"
+
+// Capture timer tick: 1 MHz, extended past 16 bit by counting wraps ///////////
+
+const uint32_t PIR_TICK_HZ =            1000000                                 ;
+
+// Defaults: shortest plausible pulse (ms), N valid pulses within a window /////
+// (ms) before they count as motion. N = 1: every valid pulse does. No /////////
+// minimum width: the light follows the rising edge, see pirFilter /////////////
+
+const uint16_t PIR_MIN_WIDTH_MS =       0                                       ;
+const uint8_t PIR_COUNT =               1                                       ;
+const uint16_t PIR_WINDOW_MS =          10000                                   ;
+
+// Valid pulses remembered for the window, the largest N ///////////////////////
+
+const uint8_t PIR_HISTORY =             8                                       ;
+
+typedef struct
+{
+    uint32_t    accepted    ;   // Detections passed to the handler
+    uint32_t    tooShort    ;   // Rejected: narrower than the minimum width
+    uint32_t    unconfirmed ;   // Rejected: valid, but fewer than N in window
+    uint32_t    width       ;   // Last pulse, ms (rising to falling edge)
+    uint32_t    interval    ;   // Between the last two valid pulses, ms
+} PirStats                                                                      ;
+
+/*******************************************************************************
+ * Function Name  : pirBegin
+ * Description    : Times the PIR output with TIM4 input capture instead of a
+ *                  pin interrupt. Channels 1 and 2 both capture the pin, one
+ *                  the rising and one the falling edge, through the timer's
+ *                  input filter (8 samples at 2.25 MHz). Each rising edge
+ *                  arms CC3 at the minimum width (if any); if the pin is
+ *                  still high then, the pulse is valid, and if N valid ones
+ *                  fell into the window the handler runs, from the capture
+ *                  interrupt. Nothing is polled. TIM4 is taken over, its other pins
+ *                  can't be PWM outputs.
+ * Input          : Pin (TIM4 channel 1 or 2: D1 or D0), Handler
+ * Output         : None.
+ * Return         : false if the pin has no TIM4 channel 1 or 2
+ *******************************************************************************/
+
+boolean                 pirBegin        (uint8_t pin, void (*handler)(void))    ;
+
+/*******************************************************************************
+ * Function Name  : pirFilter
+ * Description    : Sets the validation filter, from the next pulse on.
+ *                  A pulse is only known to be wide enough once the minimum
+ *                  width has passed, so that's when the handler runs: every
+ *                  ms of width filters more EMI pulses and adds a ms to the
+ *                  edge to light latency. At 0 the handler runs from the
+ *                  rising edge (within ~15us) and only the input filter's
+ *                  few us reject spikes; the N-of-window count still guards
+ *                  against lone false triggers.
+ * Input          : Minimum width in ms (0: the rising edge is enough), N
+ *                  (1 - PIR_HISTORY), Window in ms
+ * Output         : None.
+ * Return         : false (filter unchanged) if N is out of range
+ *******************************************************************************/
+
+boolean                 pirFilter       (uint16_t width, uint8_t n,
+                                         uint16_t window)                       ;
+
+/*******************************************************************************
+ * Function Name  : pirAge
+ * Description    : Time since the rising edge of the pulse that was just
+ *                  accepted, e.g. from the handler for the edge to light
+ *                  latency
+ * Input          : None.
+ * Output         : None.
+ * Return         : Microseconds
+ *******************************************************************************/
+
+uint32_t                pirAge          (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : pirStats
+ * Description    : Counters and the last measurements, taken atomically
+ * Input          : None.
+ * Output         : Stats
+ * Return         : None
+ *******************************************************************************/
+
+void                    pirStats        (PirStats *stats)                       ;
+
+#endif
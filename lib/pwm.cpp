@@ -3,8 +3,484 @@ https://gist.github.com/technobly/8313449 Thanks @ (Technobly/BDub)
 */
 
 #include "pwm.h"
+#include "gamma.h"
+
+uint16_t TIM_ARR        =               PWM_ARR                                 ;
+
+// Perceptual level -> compare value, generated at compile time (flash)
+static constexpr GammaLUT GAMMA = makeGammaLUT(PWM_ARR + 1, gamma_lut::make_seq<256>::type());
+
+static void             setDuty         (uint8_t pin, uint16_t ccr)             ;
 
 void                    setPWM          (uint8_t pin, uint8_t value)
+{
+    setDuty(pin, GAMMA.v[value]);
+}
+
+// 16 bit level -> compare value at PWM_ARR in 8.8 fixed point, interpolating
+// between entries
+static uint32_t         gamma16q8       (uint16_t value)
+{
+    // value * 255 / 65535 as 8.8 fixed point; +255 makes 65535 land on 255.0
+    uint32_t pos        = (uint32_t) value * 255 + 255;
+    uint8_t  idx        = pos >> 16;
+    uint32_t lo         = (uint32_t) GAMMA.v[idx] << 8;
+
+    if (idx == 255)
+    {
+        return lo;
+    }
+
+    uint8_t  frac       = pos >> 8;
+    return lo + (uint32_t)(GAMMA.v[idx + 1] - GAMMA.v[idx]) * frac;
+}
+
+void                    setPWM16        (uint8_t pin, uint16_t value)
+{
+    setDuty(pin, gamma16q8(value) >> 8);
+}
+
+// Writes to channels that failed begin() land here
+static volatile uint16_t pwmSink                                                ;
+
+// Per timer state: its PwmChannels, dither stage and interrupt cost
+class PwmTimer
+{
+    public:
+
+        TIM_TypeDef        *tim                                                 ;
+        uint8_t             irq                                                 ;
+        uint8_t             mode                                                ;
+        uint8_t             bits                                                ;
+        uint8_t             mask                                                ;
+        PwmChannel         *ch          [4]                                     ;
+        uint8_t             n                                                   ;
+        uint32_t            cyclesAvg16                                         ;
+        uint32_t            cyclesMax                                           ;
+        volatile boolean    paused                                              ;
+
+        static PwmTimer    *find        (TIM_TypeDef *tim)                      ;
+        void                attach      (PwmChannel *c)                         ;
+        void                rescale     (uint32_t top, uint32_t old)            ;
+        void                configure   (void)                                  ;
+        void                dither      (void)                                  ;
+};
+
+static PwmTimer         timers[]        =
+{
+    { TIM2, TIM2_IRQn, PWM_DITHER_AUTO, 0, 0, { NULL }, 0, 0, 0, false },
+    { TIM3, TIM3_IRQn, PWM_DITHER_AUTO, 0, 0, { NULL }, 0, 0, 0, false },
+    { TIM4, TIM4_IRQn, PWM_DITHER_AUTO, 0, 0, { NULL }, 0, 0, 0, false },
+};
+
+PwmTimer               *PwmTimer::find  (TIM_TypeDef *tim)
+{
+    for (uint8_t t = 0; t < sizeof(timers) / sizeof(timers[0]); t++)
+    {
+        if (timers[t].tim == tim)
+        {
+            return &timers[t];
+        }
+    }
+
+    return NULL;
+}
+
+void                    PwmTimer::attach(PwmChannel *c)
+{
+    c->_ccr = bits ? &c->_shadow : c->_hw;
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        if (ch[i] == c)
+        {
+            return;
+        }
+    }
+
+    if (n < 4)
+    {
+        ch[n++] = c;
+    }
+}
+
+// Call with UDIS set: moves every channel from old to top counts per period
+void                    PwmTimer::rescale(uint32_t top, uint32_t old)
+{
+    for (uint8_t i = 0; i < n; i++)
+    {
+        PwmChannel *c = ch[i];
+        uint16_t ccr = (uint32_t)(*c->_ccr) * top / old;
+
+        c->_scale  = ((uint64_t) top << 16) / (PWM_ARR + 1);
+        c->_shadow = ccr;
+        *c->_hw    = ccr;
+    }
+}
+
+static void             ditherTIM2      (void)  { timers[0].dither(); }
+static void             ditherTIM3      (void)  { timers[1].dither(); }
+static void             ditherTIM4      (void)  { timers[2].dither(); }
+
+// Call with UDIS set: applies mode to the current rate
+void                    PwmTimer::configure(void)
+{
+    uint32_t top        = tim->ARR + 1;
+    uint32_t rate       = pwmGetFrequency(tim);
+    boolean  on         = (mode == PWM_DITHER_ON) ||
+                          (mode == PWM_DITHER_AUTO && top < PWM_DITHER_TOP);
+    uint8_t  was        = bits;
+
+    // As many fraction bits as keep 2^bits periods above PWM_DITHER_MIN_HZ
+    bits = 0;
+
+    while (on && bits < 8 && (rate >> (bits + 1)) >= PWM_DITHER_MIN_HZ)
+    {
+        bits++;
+    }
+
+    mask = (uint8_t)(0xFF00 >> bits);
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        ch[i]->_shadow = *ch[i]->_ccr;
+        ch[i]->_acc    = 0;
+        ch[i]->_ccr    = bits ? &ch[i]->_shadow : ch[i]->_hw;
+    }
+
+    if (bits && !was)
+    {
+        NVIC_InitTypeDef NVIC_InitStructure;
+
+        if (tim == TIM2)
+        {
+            Wiring_TIM2_Interrupt_Handler = ditherTIM2;
+        }
+        else if (tim == TIM3)
+        {
+            Wiring_TIM3_Interrupt_Handler = ditherTIM3;
+        }
+        else
+        {
+            Wiring_TIM4_Interrupt_Handler = ditherTIM4;
+        }
+
+#if PWM_PROFILE
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA;
+#endif
+        cyclesAvg16 = 0;
+        cyclesMax   = 0;
+
+        NVIC_InitStructure.NVIC_IRQChannel = irq;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 10;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&NVIC_InitStructure);
+
+        tim->SR = (uint16_t) ~TIM_SR_UIF;
+        tim->DIER |= TIM_DIER_UIE;
+    }
+    else if (!bits && was)
+    {
+        tim->DIER &= (uint16_t) ~TIM_DIER_UIE;
+    }
+}
+
+// Update interrupt: the CCRx written now is preloaded for the next period.
+// First order sigma-delta, the carry out of the accumulator adds one count.
+void                    PwmTimer::dither(void)
+{
+#if PWM_PROFILE
+    uint32_t start = DWT->CYCCNT;
+#endif
+
+    tim->SR = (uint16_t) ~TIM_SR_UIF;
+
+    // Someone else (DMA) owns the compare registers for now
+    if (paused)
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < n; i++)
+    {
+        PwmChannel *c = ch[i];
+        uint16_t sum = c->_acc + (c->_frac & mask);
+
+        c->_acc = sum;
+        *c->_hw = c->_shadow + (sum >> 8);
+    }
+
+#if PWM_PROFILE
+    uint32_t cycles = DWT->CYCCNT - start;
+
+    cyclesAvg16 += cycles - (cyclesAvg16 >> 4);
+
+    if (cycles > cyclesMax)
+    {
+        cyclesMax = cycles;
+    }
+#endif
+}
+
+PwmChannel::PwmChannel  (void)
+    : _ccr(&pwmSink), _hw(&pwmSink), _tim(NULL), _scale(65536),
+      _shadow(0), _frac(0), _acc(0), _pin(0xFF)
+{
+}
+
+boolean                 PwmChannel::begin(uint8_t pin)
+{
+    _ccr = &pwmSink;
+    _hw  = &pwmSink;
+    _tim = NULL;
+    _pin = pin;
+
+    // Runs every check and the timer init; leaves the pin in AF mode on success
+    setDuty(pin, 0);
+
+    if (pin >= TOTAL_PINS || PIN_MAP[pin].timer_peripheral == NULL ||
+        PIN_MAP[pin].pin_mode != AF_OUTPUT_PUSHPULL)
+    {
+        return false;
+    }
+
+    _tim = PIN_MAP[pin].timer_peripheral;
+
+    if (PIN_MAP[pin].timer_ch == TIM_Channel_1)
+    {
+        _hw = &_tim->CCR1;
+    }
+    else if (PIN_MAP[pin].timer_ch == TIM_Channel_2)
+    {
+        _hw = &_tim->CCR2;
+    }
+    else if (PIN_MAP[pin].timer_ch == TIM_Channel_3)
+    {
+        _hw = &_tim->CCR3;
+    }
+    else
+    {
+        _hw = &_tim->CCR4;
+    }
+
+    // Gamma table is built for PWM_ARR, rescale if the timer counts further
+    _scale  = ((uint64_t)(_tim->ARR + 1) << 16) / (PWM_ARR + 1);
+    _shadow = 0;
+    _acc    = 0;
+    _ccr    = _hw;
+
+    PwmTimer *t = PwmTimer::find(_tim);
+
+    if (t != NULL)
+    {
+        t->attach(this);
+    }
+
+    return true;
+}
+
+uint16_t                PwmChannel::duty(uint16_t value) const
+{
+    return ((uint64_t) gamma16q8(value) * _scale) >> 24;
+}
+
+uint16_t                PwmChannel::stage(uint16_t value)
+{
+    uint32_t ccr = ((uint64_t) gamma16q8(value) * _scale) >> 16;
+
+    _frac = ccr;
+    return ccr >> 8;
+}
+
+void                    PwmChannel::set (uint16_t value)
+{
+    write(stage(value));
+}
+
+uint32_t                pwmSetFrequency (TIM_TypeDef *tim, uint32_t hz)
+{
+    PwmTimer *t = PwmTimer::find(tim);
+
+    if (t == NULL || hz == 0)
+    {
+        return 0;
+    }
+
+    // Timer clock (APB1 x2) equals the core clock. Smallest prescaler that
+    // fits ARR gives the most counts per period; keep at least 8 bits
+    uint32_t ticks      = SystemCoreClock / hz;
+
+    if (ticks < 256)
+    {
+        return 0;
+    }
+
+    uint16_t psc        = (ticks - 1) >> 16;
+    uint32_t top        = ticks / (psc + 1);
+    uint32_t old        = tim->ARR + 1;
+
+    // Nothing below reaches the counter before the next update event
+    tim->CR1 |= TIM_CR1_UDIS;
+
+    tim->PSC = psc;
+    tim->ARR = top - 1;
+
+    t->rescale(top, old);
+    t->configure();
+
+    tim->CR1 &= (uint16_t) ~TIM_CR1_UDIS;
+
+    return SystemCoreClock / (psc + 1) / top;
+}
+
+uint32_t                pwmGetFrequency (TIM_TypeDef *tim)
+{
+    if (PwmTimer::find(tim) == NULL)
+    {
+        return 0;
+    }
+
+    return SystemCoreClock / (tim->PSC + 1) / (tim->ARR + 1);
+}
+
+uint8_t                 pwmSetDither    (TIM_TypeDef *tim, uint8_t mode)
+{
+    PwmTimer *t = PwmTimer::find(tim);
+
+    if (t == NULL)
+    {
+        return 0;
+    }
+
+    tim->CR1 |= TIM_CR1_UDIS;
+
+    t->mode   = mode;
+    t->paused = false;
+    t->configure();
+
+    tim->CR1 &= (uint16_t) ~TIM_CR1_UDIS;
+
+    return t->bits;
+}
+
+void                    pwmPauseDither  (TIM_TypeDef *tim)
+{
+    PwmTimer *t = PwmTimer::find(tim);
+
+    if (t != NULL)
+    {
+        t->paused = true;
+    }
+}
+
+uint8_t                 pwmGetDither    (TIM_TypeDef *tim)
+{
+    PwmTimer *t = PwmTimer::find(tim);
+
+    return (t != NULL) ? t->mode : PWM_DITHER_OFF;
+}
+
+uint16_t                pwmDitherLoad   (TIM_TypeDef *tim, uint32_t *avgCycles,
+                                         uint32_t *maxCycles)
+{
+    PwmTimer *t = PwmTimer::find(tim);
+    uint32_t avg = (t != NULL) ? t->cyclesAvg16 >> 4 : 0;
+
+    if (avgCycles != NULL)
+    {
+        *avgCycles = avg;
+    }
+
+    if (maxCycles != NULL)
+    {
+        *maxCycles = (t != NULL) ? t->cyclesMax : 0;
+    }
+
+    if (t == NULL || t->bits == 0)
+    {
+        return 0;
+    }
+
+    // One interrupt per PWM period
+    return (uint64_t) avg * pwmGetFrequency(tim) * 1000 / SystemCoreClock;
+}
+
+PwmGroup::PwmGroup      (void)
+    : _n(0), _timers(0)
+{
+}
+
+int8_t                  PwmGroup::add   (PwmChannel *ch)
+{
+    for (uint8_t i = 0; i < _n; i++)
+    {
+        if (_ch[i] == ch)
+        {
+            return i;
+        }
+    }
+
+    if (_n >= PWM_GROUP_MAX)
+    {
+        return -1;
+    }
+
+    _ch[_n] = ch;
+
+    // Remember each timer once, that's what hold() and release() act on
+    boolean known = (ch->timer() == NULL);
+
+    for (uint8_t t = 0; t < _timers && !known; t++)
+    {
+        known = (_tim[t] == ch->timer());
+    }
+
+    if (!known)
+    {
+        _tim[_timers++] = ch->timer();
+    }
+
+    return _n++;
+}
+
+void                    PwmGroup::hold  (void)
+{
+    for (uint8_t t = 0; t < _timers; t++)
+    {
+        _tim[t]->CR1 |= TIM_CR1_UDIS;
+    }
+}
+
+void                    PwmGroup::release(void)
+{
+    for (uint8_t t = 0; t < _timers; t++)
+    {
+        _tim[t]->CR1 &= (uint16_t) ~TIM_CR1_UDIS;
+    }
+}
+
+void                    PwmGroup::set   (const uint16_t *values)
+{
+    uint16_t ccr[PWM_GROUP_MAX];
+
+    for (uint8_t i = 0; i < _n; i++)
+    {
+        ccr[i] = _ch[i]->stage(values[i]);
+    }
+
+    hold();
+
+    for (uint8_t i = 0; i < _n; i++)
+    {
+        _ch[i]->write(ccr[i]);
+    }
+
+    release();
+}
+
+static void             setDuty         (uint8_t pin, uint16_t ccr)
 {
     TIM_OCInitTypeDef TIM_OCInitStructure;
 
@@ -41,7 +517,13 @@ void                    setPWM          (uint8_t pin, uint8_t value)
     // just update duty cycle and return.
     if (PIN_MAP[pin].pin_mode == AF_OUTPUT_PUSHPULL)
     {
-        TIM_OCInitStructure.TIM_Pulse = (uint16_t)(value * (TIM_ARR + 1) / 255);
+        // ccr is on the PWM_ARR scale, follow a pwmSetFrequency() change
+        if (PIN_MAP[pin].timer_peripheral->ARR != PWM_ARR)
+        {
+            ccr = (uint32_t) ccr * (PIN_MAP[pin].timer_peripheral->ARR + 1) / (PWM_ARR + 1);
+        }
+
+        TIM_OCInitStructure.TIM_Pulse = ccr;
 
         if (PIN_MAP[pin].timer_ch == TIM_Channel_1)
         {
@@ -69,7 +551,7 @@ void                    setPWM          (uint8_t pin, uint8_t value)
     uint16_t TIM_Prescaler = (uint16_t)(SystemCoreClock / 24000000) - 1;
 
     // TIM Channel Duty Cycle(%) = (TIM_CCR / TIM_ARR + 1) * 100
-    uint16_t TIM_CCR = (uint16_t)(value * (TIM_ARR + 1) / 255);
+    uint16_t TIM_CCR = ccr;
 
     // AFIO clock enable
     RCC_APB2PeriphClockCmd(RCC_APB2Periph_AFIO, ENABLE);
@@ -90,13 +572,21 @@ void                    setPWM          (uint8_t pin, uint8_t value)
         RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
     }
 
-    // Time base configuration
-    TIM_TimeBaseStructure.TIM_Period = TIM_ARR;
-    TIM_TimeBaseStructure.TIM_Prescaler = TIM_Prescaler;
-    TIM_TimeBaseStructure.TIM_ClockDivision = 0;
-    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    // Time base configuration, unless the timer already runs other channels
+    // (possibly at a pwmSetFrequency() rate)
+    if ((PIN_MAP[pin].timer_peripheral->CR1 & TIM_CR1_CEN) == 0)
+    {
+        TIM_TimeBaseStructure.TIM_Period = TIM_ARR;
+        TIM_TimeBaseStructure.TIM_Prescaler = TIM_Prescaler;
+        TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+        TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
 
-    TIM_TimeBaseInit(PIN_MAP[pin].timer_peripheral, & TIM_TimeBaseStructure);
+        TIM_TimeBaseInit(PIN_MAP[pin].timer_peripheral, & TIM_TimeBaseStructure);
+    }
+    else if (PIN_MAP[pin].timer_peripheral->ARR != PWM_ARR)
+    {
+        TIM_CCR = (uint32_t) TIM_CCR * (PIN_MAP[pin].timer_peripheral->ARR + 1) / (PWM_ARR + 1);
+    }
 
     // PWM1 Mode configuration
     TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
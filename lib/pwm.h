@@ -1,19 +1,295 @@
+#ifndef PWM_H
+#define PWM_H
+
 #include "application.h"
 
+// Measure the dither interrupt with the DWT cycle counter, see pwmDitherLoad()
+#ifndef PWM_PROFILE
+#define PWM_PROFILE 1
+#endif
+
 // Desired PWM Frequency in Hertz //////////////////////////////////////////////
 
 const uint16_t PWM_FREQ =               1000                                    ;
 
-// Don't change! ///////////////////////////////////////////////////////////////
+// Don't change! (TIM_ARR defined in pwm.cpp) /////////////////////////////////
+
+const uint16_t PWM_ARR  =               (24000000 / PWM_FREQ) - 1               ;
 
-uint16_t TIM_ARR        = (uint16_t)    (24000000/PWM_FREQ)-1                   ;
+extern uint16_t TIM_ARR                                                         ;
 
 /*******************************************************************************
  * Function Name  : setPWM
- * Description    : Sets the PIN's desired autonomous PWM duty cycle
- * Input          : Pin, PWM Value (0-254)
+ * Description    : Sets the PIN's desired autonomous PWM duty cycle, CIE1931
+ *                  corrected so equal steps look equally bright
+ * Input          : Pin, PWM Value (0-255)
  * Output         : None.
  * Return         : None
  *******************************************************************************/
 
 void                    setPWM          (uint8_t pin, uint8_t value)            ;
+
+/*******************************************************************************
+ * Function Name  : setPWM16
+ * Description    : Sets the PIN's desired autonomous PWM duty cycle with the
+ *                  full timer resolution (TIM_ARR + 1 steps), for smooth deep
+ *                  dimming without raising the PWM frequency. CIE1931
+ *                  corrected, interpolating between the 8-bit table entries
+ * Input          : Pin, PWM Value (0-65535)
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    setPWM16        (uint8_t pin, uint16_t value)           ;
+
+/*******************************************************************************
+ * Class Name     : PwmChannel
+ * Description    : Handle on one PWM output. begin() runs the checks and timer
+ *                  setup of setPWM() once and caches the CCRx register and the
+ *                  timer scale, so write() is a single store and set() only
+ *                  adds the gamma lookup. Use for pins updated at fade rate.
+ *******************************************************************************/
+
+class PwmChannel
+{
+    public:
+
+        PwmChannel                      (void)                                  ;
+
+        /***********************************************************************
+         * Function Name  : begin
+         * Description    : Validates the pin and initialises its timer channel
+         *                  at 0% duty. On failure writes go to a dummy register
+         * Input          : Pin (already set to OUTPUT)
+         * Output         : None.
+         * Return         : true if the pin drives a PWM channel
+         ***********************************************************************/
+
+        boolean         begin           (uint8_t pin)                           ;
+
+        /***********************************************************************
+         * Function Name  : write
+         * Description    : Writes a raw compare value (0 - TIM_ARR + 1). While
+         *                  the timer dithers this lands in a RAM shadow that
+         *                  the update interrupt adds the dither bit to
+         * Input          : Compare value
+         * Output         : None.
+         * Return         : None
+         ***********************************************************************/
+
+        inline void     write           (uint16_t ccr)
+        {
+            *_ccr = ccr;
+        }
+
+        /***********************************************************************
+         * Function Name  : set
+         * Description    : Same as setPWM16() without the per-call checks
+         * Input          : PWM Value (0-65535), CIE1931 corrected
+         * Output         : None.
+         * Return         : None
+         ***********************************************************************/
+
+        void            set             (uint16_t value)                        ;
+
+        /***********************************************************************
+         * Function Name  : stage
+         * Description    : Compare value set() would write for a PWM value.
+         *                  Latches the 8 bit remainder below one timer count
+         *                  for the dither stage (see pwmSetDither())
+         * Input          : PWM Value (0-65535)
+         * Output         : None.
+         * Return         : Compare value, for write()
+         ***********************************************************************/
+
+        uint16_t        stage           (uint16_t value)                        ;
+
+        /***********************************************************************
+         * Function Name  : duty
+         * Description    : Compare value for a PWM value, without latching
+         *                  the dither remainder (for precomputed frames)
+         * Input          : PWM Value (0-65535)
+         * Output         : None.
+         * Return         : Compare value
+         ***********************************************************************/
+
+        uint16_t        duty            (uint16_t value) const                  ;
+
+        uint8_t         pin             (void) const    { return _pin; }
+        TIM_TypeDef    *timer           (void) const    { return _tim; }
+        volatile uint16_t *reg          (void) const    { return _hw; }
+
+    private:
+
+        friend class    PwmTimer                                                ;
+
+        volatile uint16_t  *_ccr                                                ;
+        volatile uint16_t  *_hw                                                 ;
+        TIM_TypeDef        *_tim                                                ;
+        uint32_t            _scale                                              ;
+        volatile uint16_t   _shadow                                             ;
+        volatile uint8_t    _frac                                               ;
+        uint8_t             _acc                                                ;
+        uint8_t             _pin                                                ;
+};
+
+// Dither stage modes (pwmSetDither) //////////////////////////////////////////
+
+const uint8_t PWM_DITHER_OFF =          0                                       ;
+const uint8_t PWM_DITHER_ON =           1                                       ;
+const uint8_t PWM_DITHER_AUTO =         2                                       ;
+
+// AUTO dithers timers with less counts per period than this ///////////////////
+
+const uint16_t PWM_DITHER_TOP =         4096                                    ;
+
+// Slowest tolerated dither cycle: fraction bits = log2(PWM rate / this) ///////
+
+const uint16_t PWM_DITHER_MIN_HZ =      100                                     ;
+
+/*******************************************************************************
+ * Function Name  : pwmSetFrequency
+ * Description    : Changes the PWM frequency of a running timer. Prescaler,
+ *                  ARR and the rescaled compare values of its PwmChannels are
+ *                  written with the update event disabled and all take effect
+ *                  at the same period boundary, so outputs don't glitch. In
+ *                  PWM_DITHER_AUTO mode (default) dithering switches on below
+ *                  PWM_DITHER_TOP counts per period (above ~17.5 kHz at 72 MHz)
+ *                  to keep the resolution of the slower rates.
+ * Input          : Timer (TIM2-TIM4), Frequency in Hz
+ * Output         : None.
+ * Return         : Frequency actually set, 0 if out of range
+ *******************************************************************************/
+
+uint32_t                pwmSetFrequency (TIM_TypeDef *tim, uint32_t hz)         ;
+
+/*******************************************************************************
+ * Function Name  : pwmGetFrequency
+ * Description    : Current PWM frequency of a timer
+ * Input          : Timer
+ * Output         : None.
+ * Return         : Frequency in Hz, 0 for an unknown timer
+ *******************************************************************************/
+
+uint32_t                pwmGetFrequency (TIM_TypeDef *tim)                      ;
+
+/*******************************************************************************
+ * Function Name  : pwmSetDither
+ * Description    : Sigma-delta stage between PwmChannel and CCRx. The timer's
+ *                  update interrupt adds each channel's fractional count to an
+ *                  accumulator and outputs the next count up on carry, so the
+ *                  duty averages to the fraction over a few periods. The
+ *                  fraction is cut to as many bits as keep the longest cycle
+ *                  above PWM_DITHER_MIN_HZ (3 bits at 1 kHz, 7 at 20 kHz) to
+ *                  stay flicker free. Cost: one interrupt per period, a fixed
+ *                  loop over at most the 4 channels of the timer.
+ * Input          : Timer, PWM_DITHER_OFF / _ON / _AUTO
+ * Output         : None.
+ * Return         : Fraction bits in use (0: not dithering)
+ *******************************************************************************/
+
+uint8_t                 pwmSetDither    (TIM_TypeDef *tim, uint8_t mode)        ;
+
+/*******************************************************************************
+ * Function Name  : pwmPauseDither
+ * Description    : Keeps the dither interrupt off the compare registers, so
+ *                  something else (a DMA stream) can write them, without
+ *                  reconfiguring the timer: it only sets a flag, so it may
+ *                  be called from an interrupt. Writes still go to the
+ *                  shadows. The next pwmSetDither() resumes.
+ * Input          : Timer
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    pwmPauseDither  (TIM_TypeDef *tim)                      ;
+
+/*******************************************************************************
+ * Function Name  : pwmGetDither
+ * Description    : Dither mode of a timer, as set by pwmSetDither()
+ * Input          : Timer
+ * Output         : None.
+ * Return         : PWM_DITHER_OFF / _ON / _AUTO
+ *******************************************************************************/
+
+uint8_t                 pwmGetDither    (TIM_TypeDef *tim)                      ;
+
+/*******************************************************************************
+ * Function Name  : pwmDitherLoad
+ * Description    : Cost of the dither interrupt (PWM_PROFILE), measured with
+ *                  the DWT cycle counter
+ * Input          : Timer
+ * Output         : Average (EMA, 1/16) and worst cycles per interrupt
+ * Return         : CPU load in permille, 0 if not dithering
+ *******************************************************************************/
+
+uint16_t                pwmDitherLoad   (TIM_TypeDef *tim, uint32_t *avgCycles,
+                                         uint32_t *maxCycles)                   ;
+
+// Channels per PwmGroup (R, G, B, W) //////////////////////////////////////////
+
+const uint8_t PWM_GROUP_MAX =           4                                       ;
+
+/*******************************************************************************
+ * Class Name     : PwmGroup
+ * Description    : Channels that change as one frame. CCRx are preloaded, so
+ *                  a write only takes effect at the next update event; hold()
+ *                  sets UDIS on every timer of the group to suppress that
+ *                  transfer while the frame is written, release() clears it
+ *                  and the next update event applies all values in the same
+ *                  PWM period. On a single timer (pinR/G/B/W are all TIM3)
+ *                  this is exact; across timers each one switches on its own
+ *                  next period.
+ *******************************************************************************/
+
+class PwmGroup
+{
+    public:
+
+        PwmGroup                        (void)                                  ;
+
+        /***********************************************************************
+         * Function Name  : add
+         * Description    : Appends a channel (after its begin()), ignores
+         *                  duplicates
+         * Input          : PwmChannel
+         * Output         : None.
+         * Return         : Index of the channel, -1 if the group is full
+         ***********************************************************************/
+
+        int8_t          add             (PwmChannel *ch)                        ;
+
+        /***********************************************************************
+         * Function Name  : hold / release
+         * Description    : Freezes / resumes the preload transfer of all timers
+         *                  of the group
+         * Input          : None.
+         * Output         : None.
+         * Return         : None
+         ***********************************************************************/
+
+        void            hold            (void)                                  ;
+        void            release         (void)                                  ;
+
+        /***********************************************************************
+         * Function Name  : set (setRGBW4)
+         * Description    : Stages the compare values of all channels, then
+         *                  writes them inside hold() / release()
+         * Input          : PWM Values (0-65535), one per channel in add() order
+         * Output         : None.
+         * Return         : None
+         ***********************************************************************/
+
+        void            set             (const uint16_t *values)                ;
+
+        uint8_t         size            (void) const    { return _n; }
+
+    private:
+
+        PwmChannel         *_ch         [PWM_GROUP_MAX]                         ;
+        TIM_TypeDef        *_tim        [PWM_GROUP_MAX]                         ;
+        uint8_t             _n                                                  ;
+        uint8_t             _timers                                             ;
+};
+
+#endif
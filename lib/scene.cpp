@@ -0,0 +1,247 @@
+/*
+Keyframe player. A scene is a list of keyframes, each one a target for some
+channels, a duration and an easing curve. The player starts every keyframe
+from the values the channels have at that moment and interpolates in 16 bit
+fixed point: elapsed time becomes a 0..65536 fraction (one divide per tick),
+the easing curve reshapes it and each channel moves by delta * eased >> 16.
+Keyframes are timed from the end of the previous one, so a late tick never
+stretches a timeline.
+*/
+
+#include "scene.h"
+
+static const Scene     *playing         =               NULL                    ;
+static uint8_t          current                                                 ;
+static uint32_t         kfStart                                                 ;
+static uint32_t         kfDuration                                              ;
+static uint8_t          mask                                                    ;
+static uint16_t         from            [FADE_CHANNELS]                         ;
+static uint16_t         to              [FADE_CHANNELS]                         ;
+
+// User scenes: slices of one keyframe pool, kept back to back
+static Keyframe         pool            [SCENE_POOL]                            ;
+static uint8_t          poolUsed        =               0                       ;
+static Scene            user            [SCENE_USER]                            ;
+static int8_t           openSlot        =               -1                      ;
+
+// Fraction 0..65536 -> eased fraction 0..65536
+static uint32_t         ease            (uint8_t curve, uint32_t t)
+{
+    switch (curve)
+    {
+        case EASE_IN:
+            return ((uint64_t) t * t) >> 16;
+
+        case EASE_OUT:
+            // 65536^2 doesn't fit 32 bit, t == 0 would come out as done
+            return 65536 - (((uint64_t)(65536 - t) * (65536 - t)) >> 16);
+
+        case EASE_INOUT:
+            // 3t^2 - 2t^3
+            return ((uint64_t) t * t * (3 * 65536 - 2 * t)) >> 32;
+
+        case EASE_STEP:
+            return (t < 65536) ? 0 : 65536;
+
+        default:
+            return t;
+    }
+}
+
+// Keyframe targets from the current values, returns the mask and duration
+static uint8_t          target          (const Keyframe *k, uint16_t *from,
+                                         uint16_t *to, uint32_t *duration)
+{
+    uint8_t  m = k->flags & KF_RGBW;
+    uint16_t widest = 0;
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        from[ch] = fadeValue(ch);
+        to[ch]   = k->rgbw[ch] * 257;
+
+        // Directional keyframes leave channels that would go the other way
+        if (((k->flags & KF_RAISE) && to[ch] < from[ch]) ||
+            ((k->flags & KF_LOWER) && to[ch] > from[ch]))
+        {
+            m &= ~(1 << ch);
+        }
+
+        if (!(m & (1 << ch)))
+        {
+            to[ch] = from[ch];
+        }
+
+        uint16_t delta = (to[ch] > from[ch]) ? to[ch] - from[ch] : from[ch] - to[ch];
+        widest = (delta > widest) ? delta : widest;
+    }
+
+    // Rate keyframes scale with the distance, like the old per-step fades
+    *duration = (k->flags & KF_RATE) ? (uint32_t) widest * k->duration / 257
+                                     : k->duration;
+
+    return m;
+}
+
+static void             begin           (uint32_t now)
+{
+    kfStart = now;
+    mask    = target(&playing->frames[current], from, to, &kfDuration);
+}
+
+void                    scenePlay       (const Scene *scene)
+{
+    if (scene == NULL || scene->count == 0)
+    {
+        playing = NULL;
+        return;
+    }
+
+    playing = scene;
+    current = 0;
+    begin(millis());
+}
+
+uint32_t                scenePreview    (const Scene *scene, uint16_t *targets)
+{
+    uint16_t now[FADE_CHANNELS];
+    uint32_t duration = 0;
+
+    if (scene == NULL || scene->count == 0)
+    {
+        for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+        {
+            targets[ch] = fadeValue(ch);
+        }
+
+        return 0;
+    }
+
+    target(&scene->frames[0], now, targets, &duration);
+    return duration;
+}
+
+void                    sceneStop       (void)
+{
+    playing = NULL;
+}
+
+boolean                 sceneActive     (void)
+{
+    return playing != NULL;
+}
+
+void                    sceneTick       (void)
+{
+    if (playing == NULL)
+    {
+        return;
+    }
+
+    uint32_t now = millis();
+    uint16_t out[FADE_CHANNELS];
+
+    // Finish every keyframe whose time is up, the next one starts where the
+    // last one should have ended
+    while (now - kfStart >= kfDuration)
+    {
+        fadeWrite(to, mask);
+
+        uint32_t end = kfStart + kfDuration;
+
+        if (++current >= playing->count)
+        {
+            if (!(playing->flags & SCENE_LOOP))
+            {
+                playing = NULL;
+                return;
+            }
+
+            current = 0;
+        }
+
+        begin(end);
+
+        // Zero length loops would spin here forever
+        if (kfDuration == 0 && current == 0)
+        {
+            fadeWrite(to, mask);
+            playing = NULL;
+            return;
+        }
+    }
+
+    uint32_t e = ease(playing->frames[current].ease,
+                      ((uint64_t)(now - kfStart) << 16) / kfDuration);
+
+    for (uint8_t ch = 0; ch < FADE_CHANNELS; ch++)
+    {
+        out[ch] = from[ch] + (((int64_t)(to[ch] - from[ch]) * e) >> 16);
+    }
+
+    fadeWrite(out, mask);
+}
+
+int                     sceneDefine     (uint8_t slot, uint8_t flags)
+{
+    if (slot >= SCENE_USER)
+    {
+        return -1;
+    }
+
+    Scene *s = &user[slot];
+
+    if (playing == s)
+    {
+        playing = NULL;
+    }
+
+    // Drop the old keyframes, shift everything behind them down
+    if (s->count != 0)
+    {
+        uint8_t first = s->frames - pool;
+
+        memmove(&pool[first], &pool[first + s->count],
+                (poolUsed - first - s->count) * sizeof(Keyframe));
+
+        for (uint8_t i = 0; i < SCENE_USER; i++)
+        {
+            if (user[i].count != 0 && user[i].frames > s->frames)
+            {
+                user[i].frames -= s->count;
+            }
+        }
+
+        poolUsed -= s->count;
+    }
+
+    // The open scene always sits at the end, so it can grow in place
+    s->frames = &pool[poolUsed];
+    s->count  = 0;
+    s->flags  = flags;
+    openSlot  = slot;
+
+    return SCENE_POOL - poolUsed;
+}
+
+int                     sceneAppend     (uint8_t slot, const Keyframe &k)
+{
+    if ((int8_t) slot != openSlot || poolUsed >= SCENE_POOL)
+    {
+        return -1;
+    }
+
+    pool[poolUsed++] = k;
+
+    return ++user[slot].count;
+}
+
+const Scene            *sceneUser       (uint8_t slot)
+{
+    if (slot >= SCENE_USER || user[slot].count == 0)
+    {
+        return NULL;
+    }
+
+    return &user[slot];
+}
@@ -0,0 +1,156 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "application.h"
+#include "fade.h"
+
+// Keyframe easing /////////////////////////////////////////////////////////////
+
+const uint8_t EASE_LINEAR =             0                                       ;
+const uint8_t EASE_IN =                 1   /* slow start (t^2)               */;
+const uint8_t EASE_OUT =                2   /* slow end                       */;
+const uint8_t EASE_INOUT =              3   /* smoothstep                     */;
+const uint8_t EASE_STEP =               4   /* hold, jump at the end          */;
+
+// Keyframe flags: channel mask (bit n = fade channel n) and modifiers /////////
+
+const uint8_t KF_R =                    0x01                                    ;
+const uint8_t KF_G =                    0x02                                    ;
+const uint8_t KF_B =                    0x04                                    ;
+const uint8_t KF_W =                    0x08                                    ;
+const uint8_t KF_RGBW =                 0x0F                                    ;
+const uint8_t KF_RAISE =                0x10   /* only move channels up       */;
+const uint8_t KF_LOWER =                0x20   /* only move channels down     */;
+const uint8_t KF_RATE =                 0x40   /* duration is ms per 1/255    */;
+
+// Scene flags /////////////////////////////////////////////////////////////////
+
+const uint8_t SCENE_LOOP =              0x01                                    ;
+
+// User scenes and the keyframe pool they share (RAM) //////////////////////////
+
+const uint8_t SCENE_USER =              4                                       ;
+const uint8_t SCENE_POOL =              48                                      ;
+
+typedef struct
+{
+    uint8_t     rgbw[4]     ;   // Target per channel (0-255, scaled by 257)
+    uint16_t    duration    ;   // ms from the previous keyframe (see KF_RATE)
+    uint8_t     ease        ;
+    uint8_t     flags       ;   // KF_*, channels outside the mask are left alone
+} Keyframe                                                                      ;
+
+typedef struct
+{
+    const Keyframe *frames  ;
+    uint8_t         count   ;
+    uint8_t         flags   ;   // SCENE_*
+} Scene                                                                         ;
+
+/*******************************************************************************
+ * Function Name  : keyframe
+ * Description    : Builds a Keyframe in constant expressions, so timelines
+ *                  can be constexpr tables that stay in flash
+ * Input          : RGBW (0xRRGGBBWW), Duration in ms, Easing, Flags
+ * Output         : None.
+ * Return         : Keyframe
+ *******************************************************************************/
+
+constexpr Keyframe      keyframe        (uint32_t rgbw, uint16_t duration,
+                                         uint8_t ease, uint8_t flags)
+{
+    return Keyframe {{ (uint8_t)(rgbw >> 24), (uint8_t)(rgbw >> 16),
+                       (uint8_t)(rgbw >>  8), (uint8_t)(rgbw >>  0) },
+                     duration, ease, flags};
+}
+
+/*******************************************************************************
+ * Function Name  : scenePlay
+ * Description    : Starts a timeline from the current channel values,
+ *                  replacing the one playing. Returns immediately, the
+ *                  keyframes are interpolated by sceneTick()
+ * Input          : Scene (flash or sceneUser())
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    scenePlay       (const Scene *scene)                    ;
+
+/*******************************************************************************
+ * Function Name  : scenePreview
+ * Description    : Where the scene's first keyframe would take the channels
+ *                  if it started now, without playing anything (e.g. to arm
+ *                  the same move with fadeArm())
+ * Input          : Scene (NULL or empty: the channels stay)
+ * Output         : Targets (one per channel, 0-65535)
+ * Return         : Duration of the keyframe in ms
+ *******************************************************************************/
+
+uint32_t                scenePreview    (const Scene *scene, uint16_t *targets) ;
+
+/*******************************************************************************
+ * Function Name  : sceneStop
+ * Description    : Stops the timeline, channels keep their current values
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    sceneStop       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : sceneActive
+ * Description    : Tells whether a timeline is playing
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while playing
+ *******************************************************************************/
+
+boolean                 sceneActive     (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : sceneTick
+ * Description    : Advances the timeline to the current time and writes the
+ *                  interpolated values through fadeWrite(). Call on every
+ *                  pass of loop().
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    sceneTick       (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : sceneDefine
+ * Description    : Empties user scene slot and makes it the one sceneAppend()
+ *                  adds to. Its old keyframes are dropped from the pool and
+ *                  the other scenes compacted
+ * Input          : Slot (0 - SCENE_USER-1), Scene flags
+ * Output         : None.
+ * Return         : Free keyframes in the pool, -1 on a bad slot
+ *******************************************************************************/
+
+int                     sceneDefine     (uint8_t slot, uint8_t flags)           ;
+
+/*******************************************************************************
+ * Function Name  : sceneAppend
+ * Description    : Adds a keyframe to the slot last passed to sceneDefine()
+ * Input          : Slot, Keyframe
+ * Output         : None.
+ * Return         : Keyframes in the scene, -1 if the slot isn't the one being
+ *                  defined or the pool is full
+ *******************************************************************************/
+
+int                     sceneAppend     (uint8_t slot, const Keyframe &k)       ;
+
+/*******************************************************************************
+ * Function Name  : sceneUser
+ * Description    : User scene in slot, for scenePlay()
+ * Input          : Slot
+ * Output         : None.
+ * Return         : Scene, NULL if the slot is bad or empty
+ *******************************************************************************/
+
+const Scene            *sceneUser       (uint8_t slot)                          ;
+
+#endif
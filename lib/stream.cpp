@@ -0,0 +1,388 @@
+/*
+DMA waveform playback. Frames of CCR1-CCR4 values live in a circular buffer
+that the TIM3 update DMA request (DMA1 Channel 3) streams into TIM3_DMAR in
+burst mode (DBA = CCR1, DBL = 4 transfers), so each PWM period loads one
+frame without the CPU. Half-transfer and transfer-complete interrupts refill
+the half that was just played, stepping each channel Bresenham style like
+the fade engine: no divide and no float per frame. Each frame then goes
+through the fixture calibration like the fade engine's.
+A ramp can also be primed: buffer filled and the channel enabled, only the
+update DMA request left off. Firing it from an interrupt is then a handful
+of register writes, the first frame goes straight into the CCRs and a
+forced update event makes it live at once.
+*/
+
+#include "stream.h"
+#include "calib.h"
+
+typedef struct
+{
+    PwmChannel *pwm                                                             ;
+    uint8_t     slot                                                            ;
+    uint16_t    v                                                               ;
+    uint16_t    from                                                            ;
+    uint16_t    to                                                              ;
+    int8_t      dir                                                             ;
+    uint16_t    quot                                                            ;
+    uint32_t    rem                                                             ;
+    uint32_t    err                                                             ;
+} stream_ch_t                                                                   ;
+
+static stream_ch_t      chans           [STREAM_CHANNELS]                       ;
+static uint8_t          used            =               0                       ;
+static TIM_TypeDef     *tim             =               NULL                    ;
+
+static uint16_t         buf             [STREAM_FRAMES][STREAM_CHANNELS]        ;
+static uint16_t         idle            [STREAM_CHANNELS]                       ;
+
+static uint32_t         frames                                                  ;
+static uint32_t         pos                                                     ;
+static boolean          bounce                                                  ;
+static int8_t           endHalf                                                 ;
+static uint8_t          ditherMode                                              ;
+static volatile boolean active          =               false                   ;
+static volatile boolean primed          =               false                   ;
+static volatile boolean redither        =               false                   ;
+
+boolean                 streamAttach    (uint8_t i, PwmChannel *pwm)
+{
+    if (i >= STREAM_CHANNELS || pwm->timer() != TIM3 ||
+        (tim != NULL && tim != pwm->timer()))
+    {
+        return false;
+    }
+
+    tim = pwm->timer();
+
+    chans[i].pwm  = pwm;
+    chans[i].slot = ((uint32_t) pwm->reg() - (uint32_t) &tim->CCR1) >> 2;
+    used |= 1 << i;
+
+    return true;
+}
+
+// Bresenham split of from -> to over the frame count, as in fadeSetup()
+static void             setup           (stream_ch_t *c)
+{
+    uint32_t delta = (c->to > c->from) ? c->to - c->from : c->from - c->to;
+
+    c->v    = c->from;
+    c->dir  = (c->to > c->from) ? 1 : -1;
+    c->quot = delta / frames;
+    c->rem  = delta % frames;
+    c->err  = 0;
+}
+
+static void             fill            (uint8_t half)
+{
+    uint8_t first = half * (STREAM_FRAMES / 2);
+
+    for (uint8_t f = first; f < first + STREAM_FRAMES / 2; f++)
+    {
+        // Slots of channels that aren't streamed keep their value
+        for (uint8_t s = 0; s < STREAM_CHANNELS; s++)
+        {
+            buf[f][s] = idle[s];
+        }
+
+        if (pos == frames && bounce)
+        {
+            // Turn around, the way back is the same ramp reversed
+            for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+            {
+                uint16_t t = chans[i].from;
+
+                chans[i].from = chans[i].to;
+                chans[i].to   = t;
+                chans[i].dir  = -chans[i].dir;
+                chans[i].err  = 0;
+            }
+
+            pos = 0;
+        }
+
+        uint16_t level[STREAM_CHANNELS];
+
+        for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+        {
+            stream_ch_t *c = &chans[i];
+
+            if ((used & (1 << i)) && pos < frames)
+            {
+                uint16_t step = c->quot;
+
+                c->err += c->rem;
+
+                if (c->err >= frames)
+                {
+                    c->err -= frames;
+                    step++;
+                }
+
+                c->v += c->dir * step;
+            }
+
+            level[i] = c->v;
+        }
+
+        calibApply(level, level);
+
+        for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+        {
+            if (used & (1 << i))
+            {
+                buf[f][chans[i].slot] = chans[i].pwm->duty(level[i]);
+            }
+        }
+
+        if (pos < frames && ++pos == frames && !bounce)
+        {
+            endHalf = half;
+        }
+    }
+}
+
+static void             halt            (void)
+{
+    tim->DIER &= (uint16_t) ~TIM_DIER_UDE;
+    DMA1_Channel3->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF3;
+
+    uint16_t level[STREAM_CHANNELS];
+
+    for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+    {
+        level[i] = chans[i].v;
+    }
+
+    calibApply(level, level);
+
+    // Park the outputs on the last frame handed to the timer. set() also
+    // latches the remainder, for when a paused dither stage resumes
+    for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+    {
+        if (used & (1 << i))
+        {
+            chans[i].pwm->set(level[i]);
+        }
+    }
+
+    active   = false;
+    redither = true;
+}
+
+// Dithering back on after a ramp. Thread context only: pwmSetDither() sets
+// up the NVIC and read-modify-writes TIM3 CR1, which PwmGroup hold() and
+// release() in the main context touch as well
+static void             restore         (void)
+{
+    if (redither && !active && !primed)
+    {
+        redither = false;
+        pwmSetDither(tim, ditherMode);
+    }
+}
+
+extern "C" void         DMA1_Channel3_IRQHandler(void)
+{
+    uint32_t isr = DMA1->ISR;
+
+    DMA1->IFCR = DMA_IFCR_CGIF3;
+
+    if (!active)
+    {
+        return;
+    }
+
+    // The half that was just played is free again
+    for (uint8_t half = 0; half < 2; half++)
+    {
+        if (!(isr & (half ? DMA_ISR_TCIF3 : DMA_ISR_HTIF3)))
+        {
+            continue;
+        }
+
+        if (endHalf == half)
+        {
+            halt();
+            return;
+        }
+
+        fill(half);
+    }
+}
+
+// Everything but the DMA request: buffer, channel and interrupt ready to go
+static boolean          load            (const uint16_t *from, const uint16_t *to,
+                                         uint32_t duration, boolean loop)
+{
+    if (tim == NULL)
+    {
+        return false;
+    }
+
+    if (active || primed)
+    {
+        streamStop();
+    }
+
+    uint64_t n = (uint64_t) duration * pwmGetFrequency(tim) / 1000;
+
+    frames  = (n == 0) ? 1 : (n > 0xFFFFFFFF ? 0xFFFFFFFF : n);
+    pos     = 0;
+    bounce  = loop;
+    endHalf = -1;
+
+    for (uint8_t s = 0; s < STREAM_CHANNELS; s++)
+    {
+        idle[s] = (&tim->CCR1)[s * 2];
+    }
+
+    for (uint8_t i = 0; i < STREAM_CHANNELS; i++)
+    {
+        chans[i].from = from[i];
+        chans[i].to   = to[i];
+        setup(&chans[i]);
+    }
+
+    // Dithering back from a ramp that ended on its own, the mode is to be
+    // restored after this one too
+    restore();
+    ditherMode = pwmGetDither(tim);
+
+    fill(0);
+    fill(1);
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+    DMA1_Channel3->CCR   = 0;
+    DMA1->IFCR           = DMA_IFCR_CGIF3;
+    DMA1_Channel3->CPAR  = (uint32_t) &tim->DMAR;
+    DMA1_Channel3->CMAR  = (uint32_t) buf;
+    DMA1_Channel3->CNDTR = STREAM_FRAMES * STREAM_CHANNELS;
+    DMA1_Channel3->CCR   = DMA_CCR1_DIR | DMA_CCR1_CIRC | DMA_CCR1_MINC |
+                           DMA_CCR1_PSIZE_0 | DMA_CCR1_MSIZE_0 | DMA_CCR1_PL |
+                           DMA_CCR1_HTIE | DMA_CCR1_TCIE;
+
+    NVIC_InitTypeDef NVIC_InitStructure;
+
+    NVIC_InitStructure.NVIC_IRQChannel = DMA1_Channel3_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 10;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&NVIC_InitStructure);
+
+    // Burst from CCR1 (0x34 / 4), 4 transfers per update event
+    tim->DCR = (3 << 8) | (0x34 >> 2);
+
+    DMA1_Channel3->CCR  |= DMA_CCR1_EN;
+
+    return true;
+}
+
+boolean                 streamRamp      (const uint16_t *from, const uint16_t *to,
+                                         uint32_t duration, boolean loop)
+{
+    if (!load(from, to, duration, loop))
+    {
+        return false;
+    }
+
+    // The DMA writes CCRx directly, the dither interrupt would fight it
+    pwmSetDither(tim, PWM_DITHER_OFF);
+
+    active = true;
+    tim->DIER |= TIM_DIER_UDE;
+
+    return true;
+}
+
+boolean                 streamPrime     (const uint16_t *from, const uint16_t *to,
+                                         uint32_t duration)
+{
+    if (!load(from, to, duration, false))
+    {
+        return false;
+    }
+
+    primed = true;
+    return true;
+}
+
+boolean                 streamFire      (void)
+{
+    if (!primed)
+    {
+        return false;
+    }
+
+    // Dithering kept running while primed, it only steps aside now. Then
+    // straight into the preload registers, the forced update makes them
+    // live now instead of one period later. The DMA request it raises
+    // loads frame 0 once more, so the ramp starts with a double frame.
+    pwmPauseDither(tim);
+
+    for (uint8_t s = 0; s < STREAM_CHANNELS; s++)
+    {
+        (&tim->CCR1)[s * 2] = buf[0][s];
+    }
+
+    primed = false;
+    active = true;
+
+    tim->DIER |= TIM_DIER_UDE;
+    tim->EGR   = TIM_EGR_UG;
+
+    return true;
+}
+
+boolean                 streamDisarm    (void)
+{
+    __disable_irq();
+
+    boolean was = primed;
+
+    if (primed)
+    {
+        DMA1_Channel3->CCR = 0;
+        DMA1->IFCR = DMA_IFCR_CGIF3;
+        primed = false;
+    }
+
+    __enable_irq();
+
+    return was;
+}
+
+boolean                 streamPrimed    (void)
+{
+    return primed;
+}
+
+void                    streamStop      (void)
+{
+    streamDisarm();
+
+    __disable_irq();
+
+    if (active)
+    {
+        halt();
+    }
+
+    __enable_irq();
+
+    restore();
+}
+
+boolean                 streamActive    (void)
+{
+    restore();
+
+    return active;
+}
+
+uint16_t                streamLevel     (uint8_t i)
+{
+    return chans[i].v;
+}
@@ -0,0 +1,131 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "application.h"
+#include "pwm.h"
+
+// Frames in the circular DMA buffer, refilled half at a time //////////////////
+
+const uint8_t STREAM_FRAMES =           64                                      ;
+
+// Channels per frame (CCR1-CCR4 of one timer) /////////////////////////////////
+
+const uint8_t STREAM_CHANNELS =         4                                       ;
+
+/*******************************************************************************
+ * Function Name  : streamAttach
+ * Description    : Adds a PwmChannel to the stream. All channels must share
+ *                  one timer, and only TIM3 (update DMA on DMA1 Channel 3) is
+ *                  supported; pinR/G/B/W all are TIM3 channels
+ * Input          : Index (0-3, order of the from/to arrays), PwmChannel
+ * Output         : None.
+ * Return         : true if the channel can be streamed
+ *******************************************************************************/
+
+boolean                 streamAttach    (uint8_t i, PwmChannel *pwm)            ;
+
+/*******************************************************************************
+ * Function Name  : streamRamp
+ * Description    : Plays a linear ramp (in CIE1931 corrected levels) from
+ *                  "from" to "to" over duration, one frame per PWM period.
+ *                  Every update event bursts a frame into CCR1-CCR4 through
+ *                  TIMx_DMAR; the CPU only refills half of the buffer every
+ *                  STREAM_FRAMES / 2 periods from the DMA interrupt. With
+ *                  loop set the ramp bounces back and forth until stopped
+ *                  (breathing). The timer's dithering is paused meanwhile.
+ * Input          : Start and end levels per channel (0-65535), Duration in
+ *                  ms (one way), Loop
+ * Output         : None.
+ * Return         : true if started
+ *******************************************************************************/
+
+boolean                 streamRamp      (const uint16_t *from, const uint16_t *to,
+                                         uint32_t duration, boolean loop)       ;
+
+/*******************************************************************************
+ * Function Name  : streamPrime
+ * Description    : Prepares a one-way ramp like streamRamp() without starting
+ *                  it: the buffer is filled and the DMA channel enabled, the
+ *                  timer just doesn't request yet. Dithering carries on
+ *                  until the ramp is fired.
+ * Input          : Start and end levels per channel (0-65535), Duration (ms)
+ * Output         : None.
+ * Return         : true if primed
+ *******************************************************************************/
+
+boolean                 streamPrime     (const uint16_t *from, const uint16_t *to,
+                                         uint32_t duration)                     ;
+
+/*******************************************************************************
+ * Function Name  : streamFire
+ * Description    : Starts the primed ramp. Writes the first frame to the
+ *                  CCRs and forces an update event, so the outputs change
+ *                  within microseconds instead of at the end of the period
+ *                  (which is cut short). Dithering is paused by a flag, not
+ *                  reconfigured, and comes back once the ramp has played
+ *                  (see streamActive()). Meant for interrupts, never blocks.
+ * Input          : None.
+ * Output         : None.
+ * Return         : false if nothing was primed
+ *******************************************************************************/
+
+boolean                 streamFire      (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : streamDisarm
+ * Description    : Drops a primed ramp that hasn't been fired, atomically
+ *                  against streamFire()
+ * Input          : None.
+ * Output         : None.
+ * Return         : true if it was still primed, false if it had been fired
+ *                  (or nothing was primed)
+ *******************************************************************************/
+
+boolean                 streamDisarm    (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : streamPrimed
+ * Description    : Tells whether a primed ramp is waiting to be fired
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while primed
+ *******************************************************************************/
+
+boolean                 streamPrimed    (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : streamStop
+ * Description    : Stops playback, holding the outputs at the current frame.
+ *                  A primed ramp is dropped.
+ * Input          : None.
+ * Output         : None.
+ * Return         : None
+ *******************************************************************************/
+
+void                    streamStop      (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : streamActive
+ * Description    : Tells whether a ramp is playing. The interrupt that ends
+ *                  a ramp leaves the dither mode alone, the first call from
+ *                  loop() after that (fadeTick() polls it) puts it back.
+ *                  Don't call it from an interrupt
+ * Input          : None.
+ * Output         : None.
+ * Return         : true while playing
+ *******************************************************************************/
+
+boolean                 streamActive    (void)                                  ;
+
+/*******************************************************************************
+ * Function Name  : streamLevel
+ * Description    : Level of a channel at the frame last written to the
+ *                  buffer (at most STREAM_FRAMES periods ahead of the output)
+ * Input          : Index
+ * Output         : None.
+ * Return         : Level (0-65535)
+ *******************************************************************************/
+
+uint16_t                streamLevel     (uint8_t i)                             ;
+
+#endif